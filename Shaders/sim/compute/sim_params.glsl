@@ -0,0 +1,53 @@
+/* Simulation parameters that are constant over a tick. Shared by every shader of the simulation programs through
+   `#include "sim_params.glsl"`, which Shader expands when it reads the source. Must match SimParams in common_sim.h */
+
+layout(std140, binding = 0) uniform SimParams {
+    mat4 headTrans;                  // head transform
+    mat3 inertia;                    // inertia matrix
+    vec3 bounds;                     // simulation bounds
+    float dt;                        // delta time
+    vec3 centre;                     // simulation centre
+    float particleRadius;            // particle radius
+    vec3 fv_gravity;                 // gravity
+    float smoothingRadius;           // smoothing radius
+    vec3 fv_torque;                  // torque
+    float restDensity;               // rest density
+    vec3 up;                         // global up direction
+    float restDensityInv;            // 1 / rest density
+    ivec3 gridMinCell;               // lowest cell of a dense grid (used in helper.comp)
+    float gridCellSize;              // grid cell size (used in helper.comp)
+    ivec3 gridDims;                  // cells along each axis of a dense grid (used in helper.comp)
+    int gridDense;                   // index grid cells linearly instead of hashing them (used in helper.comp)
+    float ss_SOR;                    // stretch and shear constraint SOR value
+    float ss_k;                      // stretch and shear constraint stiffness
+    float bt_SOR;                    // bend and twist constraint SOR value
+    float bt_k;                      // bend and twist constraint stiffness
+    float dn_SOR;                    // density constraint SOR value
+    float dn_k;                      // density constraint stiffness
+    float relaxationEpsilon;         // relaxation epsilon
+    float f_cohesion;                // cohesion coefficient
+    float f_curvature;               // curvature coefficient
+    float f_viscosity;               // viscosity coefficient
+    float f_adhesion;                // adhesion coefficient
+    float f_porosity;                // porosity coefficient
+    float f_clumping;                // clumping coefficient
+    float f_l_drag;                  // linear drag
+    float f_a_drag;                  // angular drag
+    float headRad;                   // head radius
+    float fluidMassDiffusionFactor;  // fluid mass diffusion factor
+    float neighbourSkin;             // extra radius around smoothingRadius kept in the neighbour lists
+    float neighbourRebuildDistance;  // distance a particle may move before the lists are rebuilt
+    int hairParticleCount;           // hair particle count
+    int fluidParticleCount;          // fluid particle count
+    int porousParticleCount;         // porous particle count
+    int poreSamples;                 // pore sampling frequency
+    int clumpingRange;               // range to search for strands to clump with
+    int gridStencil;                 // cells searched for neighbours (used in helper.comp)
+    int xpbd;                        // solve constraints with XPBD compliance instead of stiffness and SOR
+    float ss_alpha;                  // stretch and shear constraint compliance
+    float bt_alpha;                  // bend and twist constraint compliance
+    float dn_alpha;                  // density constraint compliance
+    int tethers;                     // apply the long range attachment constraints
+    float tetherSlack;               // multiple of the rest distance each vertex may move from its root
+    int neighbourStride;             // slots of each neighbour list
+};
@@ -43,6 +43,10 @@ struct BucketData {
     int startIndex;
     int particlesInBucket;
     int nextParticleSlot;
+    int fluidStart;  // first entry holding a fluid particle
+    int poreStart;   // first entry holding a porous particle
+    int capacity;    // entries reserved for the bucket
+    int dirty;       // set if the bucket has changed since it was last sorted
     int pd; // padding
 };
 
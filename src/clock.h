@@ -0,0 +1,77 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Monotonic nanosecond clock, shared by every timer in the program
+namespace Clock {
+// Nanoseconds since the first call in the program
+inline int64_t now() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+inline double toMs(int64_t ns) { return ns * 1e-6; }
+inline double toSeconds(int64_t ns) { return ns * 1e-9; }
+}  // namespace Clock
+
+// Collects a duration per sample (e.g. per simulation tick) and summarises their distribution
+class TimingStats {
+   public:
+    struct Summary {
+        int64_t count = 0;
+        double min = 0, mean = 0, p50 = 0, p99 = 0, max = 0;  // milliseconds
+    };
+
+    void add(int64_t ns) {
+        samples.push_back(ns);
+        total += ns;
+    }
+
+    void clear() {
+        samples.clear();
+        total = 0;
+    }
+
+    int64_t count() const { return samples.size(); }
+
+    // Total of all samples in nanoseconds
+    int64_t sum() const { return total; }
+
+    Summary summarise() const {
+        Summary s;
+        if (samples.empty()) return s;
+        std::vector<int64_t> sorted = samples;
+        std::sort(sorted.begin(), sorted.end());
+        s.count = sorted.size();
+        s.min = Clock::toMs(sorted.front());
+        s.max = Clock::toMs(sorted.back());
+        s.mean = Clock::toMs(total) / s.count;
+        s.p50 = Clock::toMs(percentile(sorted, 0.5));
+        s.p99 = Clock::toMs(percentile(sorted, 0.99));
+        return s;
+    }
+
+    // Print the summary on one line, prefixed by `label`
+    void print(const char* label) const {
+        Summary s = summarise();
+        printf("%s: %lld samples, min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", label,
+               (long long)s.count, s.min, s.mean, s.p50, s.p99, s.max);
+    }
+
+   private:
+    // Nearest-rank percentile of `sorted`, with `q` in [0, 1]
+    static int64_t percentile(const std::vector<int64_t>& sorted, double q) {
+        size_t rank = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+        return sorted[rank];
+    }
+
+    std::vector<int64_t> samples;  // nanoseconds
+    int64_t total = 0;
+};
+
+#endif /* CLOCK_H */
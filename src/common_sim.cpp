@@ -13,6 +13,7 @@ float dt = 1.f / 30;
 float sdt = 1.f / 30;
 int simulationSubsteps = 5;
 int simulationIterations = 5;
+bool useXPBD = false;  // constraint stiffness comes from compliance and does not change with substeps or iterations
 int simulationTick = 0;
 int nextTick = 50;
 bool ticking = true;            // is the simulation actively moving towards the next tick?
@@ -28,8 +29,10 @@ vec3 centre{150, 50, 150};
 vec3 bounds{90, 98, 90};
 vec3 fluidBounds{};
 vec3 hairBounds{};
-DWORD totalSimTime = 0;
+TimingStats simTickTimes;  // CPU time of each call to `Simulation::simulate`
+GPUTimers gpuTimers;  // GPU time spent in each simulation stage and render pass
 vec3 fv_gravity = vec3(0, -30, 0);
+bool headless = false;  // no window or rendering. the GPU backend still needs a GL context, the CPU backend does not
 
 bool hairLoaded = false;
 bool poresLoaded = false;
@@ -1,10 +1,15 @@
 #ifndef COMMON_SIM_H
 #define COMMON_SIM_H
 
+#include <cstddef>
+
+#include "clock.h"
+#include "gputimer.h"
 #include "sm.h"
 #include "util.h"
 
 #define DISPATCH_SIZE 1024  // intel i7-1260p
+#define MAX_PARTICLE_SPEED 20  // must match maxSpeed in simulation.comp
 
 class SpatialGrid;
 
@@ -21,6 +26,7 @@ enum Phase {
 // The stage to dispatch the simulation to
 enum SimulationStage {
     APPLY_EXTERNAL_FORCES,
+    BUILD_NEIGHBOURS,
     REP_VOLUME,
     COMPUTE_DENSITIES,
     COMPUTE_VISCOSITES,
@@ -34,7 +40,124 @@ enum SimulationStage {
     CLUMPING,
     UPDATE_VELOCITIES,
     UPDATE_POROUS,
-    N_SIM_STAGES = 14
+    N_SIM_STAGES = 15,
+    LONG_RANGE_ATTACHMENT = N_SIM_STAGES  // not part of the stage loop. Run after each stretch and shear iteration
+};
+
+// Name of each SimulationStage in the GPU timings and the CPU trace
+inline const char* stageNames[N_SIM_STAGES] = {
+    "external forces", "build neighbours", "pore volume", "densities", "viscosities",
+    "fluid aux", "predict", "predict porous", "collisions", "stretch shear",
+    "bend twist", "density constraint", "clumping", "update velocities", "update porous"};
+
+// The passes of the BUILD_NEIGHBOURS stage
+enum NeighbourPass {
+    CHECK_NEIGHBOURS,   // Flag the lists as stale if any particle has moved too far since they were built
+    REFRESH_NEIGHBOURS  // Rebuild stale lists and cache the kernel values of every pair
+};
+
+// The cells searched around a particle for neighbours. Values match the GRID_STENCIL defines in helper.comp
+enum GridStencil {
+    STENCIL_27,  // Cells one interaction radius wide. Searches the particle's cell and the 26 around it
+    STENCIL_8    // Cells two interaction radii wide. Searches the 2x2x2 block of cells nearest the particle
+};
+
+// Locations of the uniforms in simulation.comp that change between dispatches of one tick.
+// Everything else is read from the `SimParams` uniform block
+enum SimDispatchUniform {
+    STAGE_UNIFORM,                    // SimulationStage to run
+    RBGS_UNIFORM,                     // red-black gauss-seidel order (0 = even, 1 = odd, -1 = ignore)
+    NEIGHBOUR_PASS_UNIFORM,           // NeighbourPass of the BUILD_NEIGHBOURS stage
+    FORCE_NEIGHBOUR_REBUILD_UNIFORM,  // rebuild the neighbour lists regardless of movement
+    N_SIM_DISPATCH_UNIFORMS
+};
+
+#define SIM_PARAMS_BINDING 0  // uniform buffer binding of `SimParams`
+
+// Parameters of the simulation shaders that are constant over a tick. Laid out in std140 to match the `SimParams` block in
+// sim_params.glsl, which is why each vec3 shares its 16 bytes with the scalar after it and the mat3 is stored as three
+// padded columns
+struct SimParams {
+    mat4 headTrans;                  // head transform
+    vec4 inertia[3];                 // inertia matrix
+    vec3 bounds;                     // simulation bounds
+    float dt;                        // substep delta time
+    vec3 centre;                     // simulation centre
+    float particleRadius;            // particle radius
+    vec3 fv_gravity;                 // gravity
+    float smoothingRadius;           // smoothing radius
+    vec3 fv_torque;                  // torque
+    float restDensity;               // rest density
+    vec3 up;                         // global up direction
+    float restDensityInv;            // 1 / rest density
+    ivec3 gridMinCell;               // lowest cell of a dense grid
+    float gridCellSize;              // grid cell size
+    ivec3 gridDims;                  // cells along each axis of a dense grid
+    int gridDense;                   // index grid cells linearly instead of hashing them
+    float ss_SOR;                    // stretch and shear constraint SOR value
+    float ss_k;                      // stretch and shear constraint stiffness
+    float bt_SOR;                    // bend and twist constraint SOR value
+    float bt_k;                      // bend and twist constraint stiffness
+    float dn_SOR;                    // density constraint SOR value
+    float dn_k;                      // density constraint stiffness
+    float relaxationEpsilon;         // relaxation epsilon
+    float f_cohesion;                // cohesion coefficient
+    float f_curvature;               // curvature coefficient
+    float f_viscosity;               // viscosity coefficient
+    float f_adhesion;                // adhesion coefficient
+    float f_porosity;                // porosity coefficient
+    float f_clumping;                // clumping coefficient
+    float f_l_drag;                  // linear drag
+    float f_a_drag;                  // angular drag
+    float headRad;                   // head radius
+    float fluidMassDiffusionFactor;  // fluid mass diffusion factor
+    float neighbourSkin;             // extra radius around smoothingRadius kept in the neighbour lists
+    float neighbourRebuildDistance;  // distance a particle may move before the lists are rebuilt
+    int hairParticleCount;           // hair particle count
+    int fluidParticleCount;          // fluid particle count
+    int porousParticleCount;         // porous particle count
+    int poreSamples;                 // pore sampling frequency
+    int clumpingRange;               // range to search for strands to clump with
+    int gridStencil;                 // cells searched for neighbours
+    int xpbd;                        // solve constraints with XPBD compliance instead of stiffness and SOR
+    float ss_alpha;                  // stretch and shear constraint compliance
+    float bt_alpha;                  // bend and twist constraint compliance
+    float dn_alpha;                  // density constraint compliance
+    int tethers;                     // apply the long range attachment constraints
+    float tetherSlack;               // multiple of the rest distance each vertex may move from its root
+    int neighbourStride;             // slots of each neighbour list
+};
+static_assert(sizeof(SimParams) == 352, "SimParams must match the std140 SimParams block in sim_params.glsl");
+static_assert(offsetof(SimParams, bounds) == 112 && offsetof(SimParams, ss_SOR) == 224, "SimParams is not std140");
+
+// The device the simulation stages run on. Chosen when the `Simulation` is constructed
+enum SimulationBackend {
+    GPU_BACKEND,  // Dispatch simulation.comp as OpenGL compute shaders
+    CPU_BACKEND   // Run the same stages on all CPU cores. Does not need a GL context
+};
+
+// How the hair constraints are solved. The CPU backend runs the strand solver as the dispatch solver
+enum HairSolver {
+    DISPATCH_SOLVER,  // Two red-black dispatches of simulation.comp per constraint per iteration
+    STRAND_SOLVER,    // One dispatch of strands.comp per substep. Each workgroup runs every iteration on its strands in shared memory
+    DIRECT_SOLVER     // One exact linear solve of each strand's constraints per substep. See direct.comp
+};
+
+// Chebyshev semi-iterative acceleration [Wan15] of the hair constraint iterations of the dispatch and strand solvers.
+// After each iteration the new iterate is extrapolated from the previous two with weight `omega`
+struct ChebyshevConfig {
+    bool enabled = false;
+    float ssRho = 0.9f;  // estimated spectral radius of the stretch and shear iterations
+    float btRho = 0.9f;  // estimated spectral radius of the bend and twist iterations
+    float gamma = 1.f;   // under-relaxation of each iterate
+    int warmup = 1;      // iterations run without acceleration while the estimate is unreliable
+
+    // Weight of iteration `k` given the weight `omega` of iteration `k - 1`
+    float omega(int k, float rho, float omega) const {
+        if (k < warmup) return 1;
+        if (k == warmup) return 2 / (2 - rho * rho);
+        return 4 / (4 - rho * rho * omega);
+    }
 };
 
 // Particle distribution
@@ -98,6 +221,7 @@ extern float dt;
 extern float sdt;
 extern int simulationSubsteps;
 extern int simulationIterations;
+extern bool useXPBD;
 extern int simulationTick;
 extern int nextTick;
 extern bool ticking;
@@ -114,7 +238,10 @@ extern vec3 bounds;
 extern vec3 fluidBounds;
 extern vec3 hairBounds;
 extern vec3 fv_gravity;
-extern DWORD totalSimTime;
+extern TimingStats simTickTimes;
+extern GPUTimers gpuTimers;
+
+extern bool headless;
 
 extern bool hairLoaded;
 extern bool poresLoaded;
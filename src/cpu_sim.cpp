@@ -0,0 +1,713 @@
+#include "cpu_sim.h"
+#include "kernels.h"
+
+namespace Sim {
+
+/* Constants. See simulation.comp */
+static const float collisionResolutionSpeed = 10;
+static const float maxSpeed = MAX_PARTICLE_SPEED;
+
+static float sqLen(vec3 p) { return dot(p, p); }
+static vec3 Im(quat q) { return vec3(q.x, q.y, q.z); }
+static quat pureQuat(vec3 v) { return quat(0, v.x, v.y, v.z); }
+static vec4 clampToBounds(vec4 p) {
+    vec3 halfBounds = (bounds - vec3(particleRadius)) / 2.f;
+    return vec4(Util::clampV(vec3(p), centre - halfBounds, centre + halfBounds), 0);
+}
+
+// Extrapolate Chebyshev iterate `x` from the previous two, `prev` and `cur`, and advance them. See chebyshev.comp
+template <typename T>
+static T accelerate(T x, float omega, float gamma, T& prev, T& cur) {
+    T next = omega * (gamma * (x - cur) + cur - prev) + prev;
+    prev = cur;
+    cur = next;
+    return next;
+}
+
+/* 6x6 blocks of the direct solver as [[a, b], [c, d]] of 3x3 matrices, and 6-vectors as (x, y). See direct.comp */
+struct Block6 {
+    mat3 a{0}, b{0}, c{0}, d{0};
+};
+struct Vec6 {
+    vec3 x{0}, y{0};
+};
+static Block6 operator*(const Block6& m, const Block6& n) {
+    return {m.a * n.a + m.b * n.c, m.a * n.b + m.b * n.d, m.c * n.a + m.d * n.c, m.c * n.b + m.d * n.d};
+}
+static Vec6 operator*(const Block6& m, const Vec6& v) { return {m.a * v.x + m.b * v.y, m.c * v.x + m.d * v.y}; }
+static Block6 operator-(const Block6& m, const Block6& n) { return {m.a - n.a, m.b - n.b, m.c - n.c, m.d - n.d}; }
+static Vec6 operator-(const Vec6& u, const Vec6& v) { return {u.x - v.x, u.y - v.y}; }
+static Block6 transpose(const Block6& m) { return {transpose(m.a), transpose(m.c), transpose(m.b), transpose(m.d)}; }
+// Invert a symmetric positive definite block through its Schur complement
+static Block6 inverse(const Block6& m) {
+    mat3 ai = inverse(m.a);
+    mat3 si = inverse(m.d - m.c * ai * m.b);
+    mat3 aib = ai * m.b;
+    mat3 cai = m.c * ai;
+    return {ai + aib * si * cai, -aib * si, -si * cai, si};
+}
+// [v]x, so that [v]x u = cross(v, u)
+static mat3 crossMatrix(vec3 v) { return mat3(0, v.z, -v.y, -v.z, 0, v.x, v.y, -v.x, 0); }
+// Add compliance to the diagonal of a constraint block with stiffness `k`, so that lower stiffnesses correct less.
+// In XPBD mode the compliance is `alpha` instead, scaled by the substep `sdt`
+static mat3 soften(mat3 m, float k, float alpha, float sdt) {
+    if (useXPBD) return m + mat3(alpha / (sdt * sdt) + 1e-6f);
+    k = glm::clamp(k, 1e-3f, 1.f);
+    float diag = (m[0][0] + m[1][1] + m[2][2]) / 3;
+    return m + mat3((1 - k) / k * diag + 1e-6f);
+}
+
+void CPUSimulation::simulate() {
+    stepDt = dt / simulationSubsteps;
+    fluid->restDensityInv = 1.f / fluid->restDensity;
+    inertiaInv = inverse(hair->inertia);
+
+    // XPBD leaves the positions where the constraints put them, so the over-relaxation factors are disabled
+    ssSOR = useXPBD ? 1 : hair->ss_SOR;
+    btSOR = useXPBD ? 2 : hair->bt_SOR;
+    dnSOR = useXPBD ? 1 : fluid->SOR;
+
+    for (int i = 0; i < simulationSubsteps; ++i) {
+        if (i > 0 && grid->everySubstep) grid->buildCPU(pool);
+        if (useXPBD) {
+            ssLambdas.assign(hair->rods.size(), vec3(0));
+            btLambdas.assign(hair->d0s.size(), vec3(0));
+        }
+        for (int stage = 0; stage < N_SIM_STAGES; ++stage) {
+            dispatch(stage);
+        }
+    }
+}
+
+void CPUSimulation::dispatch(int stage) {
+    TRACE_ZONE("CPUSimulation::dispatch", stageNames[stage]);
+    int nHair = hairParticleCount;
+    int nFluid = fluidParticleCount;
+    int nPore = porousParticleCount;
+    switch (stage) {
+        case APPLY_EXTERNAL_FORCES:
+            pool.parallelFor(0, nHair + nFluid, [&](int i) { applyExternalForces(i); });
+            break;
+        case BUILD_NEIGHBOURS: {
+            std::atomic<bool> stale = false;
+            pool.parallelFor(0, nFluid + nPore, [&](int i) {
+                if (checkNeighbourList(i)) stale.store(true, std::memory_order_relaxed);
+            });
+            bool rebuild = stale || fluid->forceNeighbourRebuild(stepDt);
+            if (rebuild) listBuilds++;
+            pool.parallelFor(0, nFluid + nPore, [&](int i) { refreshNeighbourList(i, rebuild); });
+            // widen the lists and build them again until every neighbour fits
+            while (listOverflowed) {
+                listOverflowed = false;
+                fluid->growNeighbourLists();
+                pool.parallelFor(0, nFluid + nPore, [&](int i) { refreshNeighbourList(i, true); });
+            }
+            if (fluid->neighboursStale) fluid->markNeighboursBuilt();
+            break;
+        }
+        case REP_VOLUME:
+            pool.parallelFor(0, nPore, [&](int i) { computePorousVolume(i); });
+            break;
+        case COMPUTE_DENSITIES:
+            pool.parallelFor(0, nFluid + nPore, [&](int i) { computeDensity(i); });
+            break;
+        case COMPUTE_VISCOSITES:
+            // velocities are read from neighbours, so gather every change before applying any
+            scratch.resize(nFluid);
+            pool.parallelFor(0, nFluid, [&](int i) { scratch[i] = computeViscosity(i); });
+            pool.parallelFor(0, nFluid, [&](int i) { particles[fToG(i)].v += vec4(fluid->f_viscosity * scratch[i], 0); });
+            break;
+        case COMPUTE_FLUID_AUX:
+            pool.parallelFor(0, nFluid, [&](int i) { computeFluidAuxillaries(i); });
+            break;
+        case PREDICT:
+            pool.parallelFor(0, nHair + nFluid, [&](int i) { predict(i); });
+            break;
+        case PREDICT_POROUS:
+            pool.parallelFor(0, nPore, [&](int i) { updatePorousPositions(i); });
+            break;
+        case RESOLVE_COLLISIONS:
+            pool.parallelFor(0, totalParticleCount, [&](int i) { resolveCollisions(i); });
+            break;
+        case STRETCH_SHEAR_CONSTRAINT:
+        case BEND_TWIST_CONSTRAINT:
+            if (hairSolver == DIRECT_SOLVER) {
+                // both constraints are solved together in the STRETCH_SHEAR_CONSTRAINT stage
+                if (stage == STRETCH_SHEAR_CONSTRAINT) pool.parallelFor(0, hair->numStrands, [&](int s) { solveStrandDirect(s); });
+                break;
+            }
+        {
+            bool positions = stage == STRETCH_SHEAR_CONSTRAINT;  // only stretch and shear moves the predicted positions
+            int nRods = hair->us.size();
+            if (chebyshev.enabled) {
+                psIterates[0].assign(ps.begin(), ps.begin() + nHair);
+                psIterates[1] = psIterates[0];
+                usIterates[0] = hair->us;
+                usIterates[1] = usIterates[0];
+            }
+            float omega = 1;
+            for (int iter = 0; iter < simulationIterations; ++iter) {
+                for (int rbgs = 0; rbgs < 2; ++rbgs) {
+                    pool.parallelFor(0, (nHair + 1) / 2, [&](int k) {
+                        int i = k * 2 + rbgs;
+                        if (i >= nHair) return;
+                        if (stage == STRETCH_SHEAR_CONSTRAINT) stretchAndShearConstraint(i);
+                        else bendAndTwistConstraint(i);
+                    });
+                }
+                if (chebyshev.enabled) {
+                    omega = chebyshev.omega(iter, positions ? chebyshev.ssRho : chebyshev.btRho, omega);
+                    pool.parallelFor(0, std::max(nHair, nRods), [&](int i) {
+                        if (positions && i < nHair) ps[i] = accelerate(ps[i], omega, chebyshev.gamma, psIterates[0][i], psIterates[1][i]);
+                        if (i < nRods) {
+                            quat& u = hair->us[i];
+                            u = normalize(accelerate(u, omega, chebyshev.gamma, usIterates[0][i], usIterates[1][i]));
+                            usIterates[1][i] = u;
+                        }
+                    });
+                }
+                // bound the stretch of whole strands at once rather than one segment per iteration
+                if (positions && hair->useTethers) pool.parallelFor(0, nHair, [&](int i) { longRangeAttachment(i); });
+            }
+            break;
+        }
+        case DENSITY_CONSTRAINT:
+            // positions are read from neighbours, so gather every correction before applying any
+            scratch.resize(nFluid);
+            pool.parallelFor(0, nFluid, [&](int i) { scratch[i] = densityConstraint(i); });
+            pool.parallelFor(0, nFluid, [&](int i) {
+                int i_g = fToG(i);
+                ps[i_g] = clampToBounds(ps[i_g] + vec4(scratch[i], 0));
+            });
+            break;
+        case CLUMPING:
+            // several porous particles share a hair vertex, so forces are applied serially
+            scratch.resize(nPore);
+            applied.resize(nPore);
+            pool.parallelFor(0, nPore, [&](int i) { applied[i] = computeClumpingForce(i, scratch[i]); });
+            for (int i_p = 0; i_p < nPore; ++i_p) {
+                if (!applied[i_p]) continue;
+                Rods::PoreData& pd = hair->poreData[i_p];
+                particles[pd.startIndex].d += pd.density * pd.startStrength;
+                particles[pd.endIndex].d += pd.density * pd.endStrength;
+                ps[pd.startIndex] += vec4(-hair->f_clumping * scratch[i_p] * pd.startStrength, 0);
+                ps[pd.endIndex] += vec4(-hair->f_clumping * scratch[i_p] * pd.endStrength, 0);
+            }
+            break;
+        case UPDATE_VELOCITIES:
+            pool.parallelFor(0, nHair + nFluid, [&](int i) { updateVelocities(i); });
+            break;
+        case UPDATE_POROUS:
+            pool.parallelFor(0, nPore, [&](int i) { updatePorousPositions(i); });
+            break;
+        default:
+            break;
+    }
+}
+
+/* ==================================================================== Helpers ==================================================================== */
+
+vec3 CPUSimulation::darboux(int j_h) {
+    return Im(hair->qmul(conjugate(hair->us[j_h]), hair->us[j_h + 1]));
+}
+
+float CPUSimulation::darbouxSign(int j_h) {
+    int d = toDarboux(j_h);
+    vec3 d0 = vec3(hair->d0s[d]);
+    float pos = sqLen(darboux(j_h) + d0);
+    float neg = sqLen(darboux(j_h) - d0);
+    if (neg <= pos) return 1;
+    return -1;
+}
+
+float CPUSimulation::calculateSaturation(int i_p) {
+    int i_g = pToG(i_p);
+    if (particles[i_g].t != PORE) return 0;
+    return (1 / particles[i_g].w) / (fluid->restDensity * hair->f_porosity * hair->poreData[i_p].volume + 1e-6);
+}
+
+float CPUSimulation::calcFluidConstraint(int i_f) {
+    /* [UPP13, Eq. 26] */
+    return std::min((fluid->densities[i_f] * fluid->restDensityInv) - 1, 0.f);
+}
+
+// Gradient with respect to neighbour `j_g`, given the pair's cached `spikyKernelGrad`.
+// The gradient with respect to the particle itself is accumulated by the caller
+vec3 CPUSimulation::calcFluidConstraintGrad(int j_g, vec3 spikyGrad) {
+    return -(1.f / particles[j_g].w) * fluid->restDensityInv * spikyGrad;
+}
+
+/* ==================================================================== Neighbour lists ==================================================================== */
+
+// Returns true if fluid or porous particle `i_fp` has moved far enough since its list was built to make the lists stale
+bool CPUSimulation::checkNeighbourList(int i_fp) {
+    float d = fluid->neighbourRebuildDistance(stepDt);
+    return sqLen(vec3(ps[fToG(i_fp)] - fluid->listPositions[i_fp])) > d * d;
+}
+
+// Rebuild the list of fluid or porous particle `i_fp` if `rebuild` is set, then cache the kernel values of every pair.
+// Fluid neighbours are stored first, then porous neighbours. Fluid neighbours may fill all but `PORE_NEIGHBOURS` slots.
+// Sets `listOverflowed` if a neighbour did not fit
+void CPUSimulation::refreshNeighbourList(int i_fp, bool rebuild) {
+    int i_g = fToG(i_fp);
+    int base = i_fp * fluid->neighbourStride;
+    float h = fluid->smoothingRadius;
+    ivec2& counts = fluid->neighbourCounts[i_fp];
+    if (rebuild) {
+        float r = h + fluid->neighbourSkin;
+        int n = 0;
+        int cap = fluid->neighbourStride - PORE_NEIGHBOURS;
+        long long visited = 0;
+        auto add = [&](int j_g) {
+            visited++;
+            if (j_g == i_g) return;
+            if (sqLen(vec3(ps[i_g] - ps[j_g])) > r * r) return;
+            if (n >= cap) {
+                listOverflowed.store(true, std::memory_order_relaxed);
+                return;
+            }
+            fluid->neighbours[base + n++] = j_g;
+        };
+        forEachCandidate(ps[i_g], 1, FLUID, add);
+        counts.x = n;
+        cap = fluid->neighbourStride;
+        forEachCandidate(ps[i_g], 1, PORE, add);
+        counts.y = n - counts.x;
+        fluid->listPositions[i_fp] = ps[i_g];
+        candidatesVisited.fetch_add(visited, std::memory_order_relaxed);
+    }
+
+    for (int k = 0; k < counts.x + counts.y; ++k) {
+        vec3 rij = vec3(ps[i_g] - ps[fluid->neighbours[base + k]]);
+        fluid->neighbourKernels[base + k] = vec4(spikyKernelGrad(rij, h), poly6Kernel(rij, h));
+    }
+}
+
+/* ==================================================================== Simulation ==================================================================== */
+
+void CPUSimulation::applyExternalForces(int i_hf) {
+    int i_h = gToH(i_hf);
+    Particle& p = particles[i_hf];
+
+    if (p.t == HAIR) {
+        if (i_h == getRootVertex(i_h)) return;
+        p.v += vec4(fv_gravity * std::max(1.f, p.d / 100) * stepDt, 0);
+
+        if (i_h == getTailVertex(i_h)) return;
+        Rods::Rod& rod = hair->rods[toJ(i_h)];
+        vec3 w = vec3(rod.v);
+        rod.v += vec4(inertiaInv * (hair->torque - cross(w, hair->inertia * w)) * stepDt, 0);
+    } else if (p.t == FLUID) {
+        p.v += vec4(fv_gravity * p.d * stepDt, 0);
+    }
+}
+
+void CPUSimulation::resolveCollisions(int i_g) {
+    ps[i_g] = clampToBounds(ps[i_g]);
+
+    vec3 head = vec3(hair->headTrans[3]);
+    float headRad = hair->renderHeadRadius;
+    if (sqLen(vec3(ps[i_g]) - head) < headRad * headRad) {
+        vec3 dirToSurface = normalize(vec3(ps[i_g]) - head);
+        float distToSurface = length(vec3(ps[i_g]) - (head + dirToSurface * headRad));
+        ps[i_g] += vec4(dirToSurface * distToSurface, 0) * collisionResolutionSpeed * stepDt;
+    }
+
+    ps[i_g] = clampToBounds(ps[i_g]);
+}
+
+void CPUSimulation::computePorousVolume(int i_p) {
+    int i_fp = i_p + fluidParticleCount;
+    int base = i_fp * fluid->neighbourStride;
+    float volume = poly6Kernel(vec3(0), fluid->smoothingRadius);  // the particle itself
+    ivec2 counts = fluid->neighbourCounts[i_fp];
+    for (int k = counts.x; k < counts.x + counts.y; ++k) {
+        volume += fluid->neighbourKernels[base + k].w;  // zero beyond smoothingRadius
+    }
+
+    float vol = 1 / volume;
+    if (std::isinf(vol) || std::isnan(vol)) vol = 0;
+    hair->poreData[i_p].volume = vol;
+}
+
+void CPUSimulation::computeDensity(int i_fp) {
+    int i_g = fToG(i_fp);
+    int base = i_fp * fluid->neighbourStride;
+    float density = 0;
+    if (particles[i_g].t == FLUID) density += (1.f / particles[i_g].w) * poly6Kernel(vec3(0), fluid->smoothingRadius);  // the particle itself
+    for (int k = 0; k < fluid->neighbourCounts[i_fp].x; ++k) {
+        int j_g = fluid->neighbours[base + k];
+        density += (1.f / particles[j_g].w) * fluid->neighbourKernels[base + k].w;
+    }
+
+    if (particles[i_g].t == FLUID) fluid->densities[i_fp] = density;
+    else if (particles[i_g].t == PORE) hair->poreData[i_fp - fluidParticleCount].density = density;
+}
+
+// Returns the XSPH velocity change for fluid particle `i_f`, before scaling by the viscosity coefficient
+vec3 CPUSimulation::computeViscosity(int i_f) {
+    int i_g = fToG(i_f);
+    int base = i_f * fluid->neighbourStride;
+    float h = fluid->smoothingRadius;
+    vec3 nV = vec3(0);
+    for (int k = 0; k < fluid->neighbourCounts[i_f].x; ++k) {
+        int j_g = fluid->neighbours[base + k];
+        /* [SB12], Eq. 2 */
+        vec3 vji = vec3(particles[j_g].v - particles[i_g].v);
+        vec3 xij = vec3(ps[i_g] - ps[j_g]);
+        nV += vji * (1 / (particles[j_g].w * fluid->densities[gToF(j_g)] + 1e-6f)) * viscosityKernel(xij, h);  // zero beyond smoothingRadius
+    }
+    return nV;
+}
+
+void CPUSimulation::computeFluidAuxillaries(int i_f) {
+    int i_g = fToG(i_f);
+    int base = i_f * fluid->neighbourStride;
+    float h = fluid->smoothingRadius;
+    float numer = calcFluidConstraint(i_f);
+    float denom = 0;
+    vec3 cNorm = vec3(0);
+    vec3 omega = vec3(0);
+    vec3 selfGrad = vec3(0);
+    bool nearPore = false;
+    ivec2 counts = fluid->neighbourCounts[i_f];
+    for (int k = 0; k < counts.x; ++k) {
+        int j_g = fluid->neighbours[base + k];
+        if (sqLen(vec3(ps[i_g] - ps[j_g])) > h * h) continue;
+
+        int j_f = gToF(j_g);
+        float jmass = 1.f / particles[j_g].w;
+        vec3 grad = vec3(fluid->neighbourKernels[base + k]);
+        selfGrad += jmass * grad;
+        denom += jmass * sqLen(calcFluidConstraintGrad(j_g, grad));
+        cNorm += jmass * grad / (fluid->densities[j_f] + 1e-6f);
+
+        /* vorticity confinement [MM13, Eq. 15] */
+        vec3 offs = vec3(particles[j_g].v - particles[i_g].v);
+        omega += cross(offs, grad);
+    }
+    for (int k = counts.x; k < counts.x + counts.y && !nearPore; ++k) {
+        nearPore = sqLen(vec3(ps[i_g] - ps[fluid->neighbours[base + k]])) <= h * h;
+    }
+    denom += (1.f / particles[i_g].w) * sqLen(fluid->restDensityInv * selfGrad);  // gradient with respect to the particle itself
+
+    fluid->curvatureNormals[i_f] = vec4(cNorm * h, 0);
+    // the density constraint is solved once per substep, so its XPBD multiplier always starts from zero
+    float alpha = useXPBD ? fluid->alpha / (stepDt * stepDt) : fluid->relaxationEpsilon;
+    fluid->lambdas[i_f] = -numer / (denom + alpha + 1e-6f);
+    fluid->omegas[i_f] = vec4(omega, 0);
+    float diffusion = fluid->fluidMassDiffusionFactor * fluid->densities[i_f] * stepDt;
+    if (nearPore) particles[i_g].d += diffusion;
+    else particles[i_g].d = std::max(1.f, particles[i_g].d - diffusion);
+}
+
+// [KS16], Eq. 37
+void CPUSimulation::stretchAndShearConstraint(int i_h) {
+    int i_g = hToG(i_h);
+    if (i_h == getTailVertex(i_h)) return;
+
+    int j_h = toJ(i_h);
+    quat& u = hair->us[j_h];
+
+    float l = hair->hairStrands[getStrandV(i_h)].l0;
+    float w_q = hair->rods[j_h].w;
+    float w_v1 = particles[i_g].w;
+    float w_v2 = particles[i_g + 1].w;
+
+    vec3 e3 = Util::UP;
+    vec3 d3 = mat3_cast(u) * e3;
+    vec3 C = ((vec3(ps[i_g + 1]) - vec3(ps[i_g])) / l) - d3;
+    quat e3b = hair->qmul(u, conjugate(pureQuat(e3)));
+    if (useXPBD) {
+        float alpha = hair->ss_alpha / (stepDt * stepDt);
+        vec3& lambda = ssLambdas[j_h];
+        vec3 dl = (-C - alpha * lambda) / ((w_v1 + w_v2) / (l * l) + 4 * w_q + alpha);
+        lambda += dl;
+        ps[i_g] += vec4(-w_v1 * dl / l, 0);
+        ps[i_g + 1] += vec4(w_v2 * dl / l, 0);
+        u = normalize(u - w_q * hair->qmul(pureQuat(dl), e3b));
+        return;
+    }
+    C *= l / (w_v1 + w_v2 + (w_q * 4 * l * l));
+    ps[i_g] += vec4(w_v1 * C * hair->ss_k, 0);
+    ps[i_g + 1] += vec4(-w_v2 * C * hair->ss_k, 0);
+
+    quat disp_q = (w_q * l) * hair->qmul(pureQuat(C * hair->bt_k), e3b);
+    u = normalize(u + disp_q);
+}
+
+// [KS16], Eq. 40
+void CPUSimulation::bendAndTwistConstraint(int i_h) {
+    if (i_h == getTailVertex(i_h)) return;
+    if (i_h == getTailVertex(i_h) - 1) return;
+    int j_h = toJ(i_h);
+    if (j_h == getTailRod(j_h)) return;
+
+    int d = toDarboux(j_h);
+    quat& u0 = hair->us[j_h];
+    quat& u1 = hair->us[j_h + 1];
+
+    float w_q = hair->rods[j_h].w;
+    float w_u = hair->rods[j_h + 1].w;
+    float denom = w_q + w_u;
+    vec3 omega = darboux(j_h);
+    vec3 omega0 = vec3(hair->d0s[d]);
+    if (useXPBD) {
+        float alpha = hair->bt_alpha / (stepDt * stepDt);
+        vec3& lambda = btLambdas[d];
+        quat dl = pureQuat((-(omega - darbouxSign(j_h) * omega0) - alpha * lambda) / (denom + alpha));
+        lambda += Im(dl);
+        quat dq = -w_q * hair->qmul(u1, dl);
+        quat du = w_u * hair->qmul(u0, dl);
+        u0 = normalize(u0 + dq);
+        u1 = normalize(u1 + du);
+        return;
+    }
+    quat C = pureQuat((omega - darbouxSign(j_h) * omega0) * hair->bt_k);
+    quat dq = (w_q / denom) * hair->qmul(u1, C);
+    quat du = -(w_u / denom) * hair->qmul(u0, C);
+    u0 = normalize(u0 + dq);
+    u1 = normalize(u1 + du);
+}
+
+void CPUSimulation::followHead(const mat4& delta) {
+    quat q = quat_cast(mat3(delta));
+    pool.parallelFor(0, hair->numStrands, [&](int s) {
+        const Rods::HairStrand& strand = hair->hairStrands[s];
+        for (int i = strand.startVertexIdx; i <= strand.endVertexIdx; ++i) {
+            Particle& p = particles[i];
+            if (p.w != 0) continue;
+            p.x = vec4(vec3(delta * vec4(vec3(p.x), 1)), p.x.w);
+            ps[i] = vec4(vec3(delta * vec4(vec3(ps[i]), 1)), ps[i].w);
+        }
+        for (int j = strand.startRodIdx; j <= strand.endRodIdx; ++j) {
+            if (hair->rods[j].w != 0) continue;
+            hair->rods[j].q = normalize(hair->qmul(q, hair->rods[j].q));
+            hair->us[j] = normalize(hair->qmul(q, hair->us[j]));
+        }
+    }, 64);
+}
+
+// [KCMF12]. See longRangeAttachment in simulation.comp
+void CPUSimulation::longRangeAttachment(int i_h) {
+    int i_g = hToG(i_h);
+    if (particles[i_g].w == 0) return;
+    vec3 root = vec3(ps[getRootVertex(i_h)]);
+    vec3 d = vec3(ps[i_g]) - root;
+    float maxLen = hair->tetherLengths[i_h] * hair->tetherSlack;
+    float len = length(d);
+    if (len <= maxLen) return;
+    ps[i_g] = vec4(root + d * (maxLen / len), 0);
+}
+
+// Solve every stretch/shear and bend/twist constraint of strand `s` at once. See direct.comp
+void CPUSimulation::solveStrandDirect(int s) {
+    const Rods::HairStrand& strand = hair->hairStrands[s];
+    int m = strand.nRods;
+    if (m < 1) return;
+    int v0 = strand.startVertexIdx;
+    int j0 = strand.startRodIdx;
+    int dd0 = j0 - s;
+    float l = strand.l0;
+    float il2 = 1 / (l * l);
+
+    // rotation perturbations and Darboux Jacobians are taken from the orientations before this solve
+    thread_local std::vector<vec3> d3s;
+    thread_local std::vector<mat3> Gs;
+    thread_local std::vector<Block6> Xs;
+    thread_local std::vector<Vec6> zs;
+    d3s.resize(m);
+    Gs.resize(m);
+    Xs.resize(m);
+    zs.resize(m);
+    for (int k = 0; k < m; ++k) {
+        d3s[k] = mat3_cast(hair->us[j0 + k]) * Util::UP;
+        Gs[k] = mat3(0);
+        if (k == m - 1) continue;
+        quat qc = conjugate(hair->us[j0 + k]);
+        for (int a = 0; a < 3; ++a) {
+            vec3 e(0);
+            e[a] = 1;
+            Gs[k][a] = 0.5f * Im(hair->qmul(hair->qmul(qc, pureQuat(e)), hair->us[j0 + k + 1]));
+        }
+    }
+
+    /* Forward sweep */
+    Block6 Bprev;
+    for (int k = 0; k < m; ++k) {
+        bool bt = k < m - 1;  // block has a bend/twist constraint
+        vec3 d3 = d3s[k];
+        const mat3& G = Gs[k];
+        float wp0 = particles[v0 + k].w;
+        float wp1 = particles[v0 + k + 1].w;
+        float wq0 = 4 * hair->rods[j0 + k].w;
+
+        Block6 D;
+        Vec6 r;
+        D.a = soften((wp0 + wp1) * il2 * mat3(1) + wq0 * (mat3(1) - outerProduct(d3, d3)), hair->ss_k, hair->ss_alpha, stepDt);
+        r.x = -((vec3(ps[v0 + k + 1]) - vec3(ps[v0 + k])) / l - d3);
+        Block6 B;  // coupling to the next block
+        if (bt) {
+            float wq1 = 4 * hair->rods[j0 + k + 1].w;
+            D.b = -wq0 * crossMatrix(d3) * transpose(G);
+            D.c = transpose(D.b);
+            D.d = soften((wq0 + wq1) * G * transpose(G), hair->bt_k, hair->bt_alpha, stepDt);
+            vec3 omega = darboux(j0 + k);
+            r.y = -(omega - darbouxSign(j0 + k) * vec3(hair->d0s[dd0 + k]));
+            B.a = -wp1 * il2 * mat3(1);
+            B.c = wq1 * G * transpose(crossMatrix(d3s[k + 1]));
+            if (k + 1 < m - 1) B.d = -wq1 * G * transpose(Gs[k + 1]);
+        } else {
+            D.d = mat3(1);
+        }
+
+        if (k > 0) {
+            Block6 Bt = transpose(Bprev);
+            D = D - Bt * Xs[k - 1];
+            r = r - Bt * zs[k - 1];
+        }
+        Block6 Si = inverse(D);
+        Xs[k] = Si * B;
+        zs[k] = Si * r;
+        Bprev = B;
+    }
+
+    /* Back substitution */
+    for (int k = m - 2; k >= 0; --k) zs[k] = zs[k] - Xs[k] * zs[k + 1];
+
+    /* Apply W J^T lambda */
+    for (int k = 0; k <= m; ++k) {
+        vec3 ss = k < m ? zs[k].x : vec3(0);
+        vec3 prevSS = k > 0 ? zs[k - 1].x : vec3(0);
+        ps[v0 + k] += vec4(particles[v0 + k].w * (prevSS - ss) / l, 0);
+        if (k == m) break;
+        vec3 dtheta = transpose(crossMatrix(d3s[k])) * ss - transpose(Gs[k]) * zs[k].y;
+        if (k > 0) dtheta += transpose(Gs[k - 1]) * zs[k - 1].y;
+        dtheta *= 4 * hair->rods[j0 + k].w;
+        quat& u = hair->us[j0 + k];
+        u = normalize(u + 0.5f * hair->qmul(pureQuat(dtheta), u));
+    }
+}
+
+// Returns the position correction for fluid particle `i_f`, including surface tension and adhesion
+vec3 CPUSimulation::densityConstraint(int i_f) {
+    int i_g = fToG(i_f);
+    int base = i_f * fluid->neighbourStride;
+    float h = fluid->smoothingRadius;
+    float imass = 1.f / particles[i_g].w;
+    vec3 deltaP = vec3(0);
+    // positions have moved since the substep began, so kernels are recomputed instead of read from the cache
+    for (int k = 0; k < fluid->neighbourCounts[i_f].x + fluid->neighbourCounts[i_f].y; ++k) {
+        int j_g = fluid->neighbours[base + k];
+        if (sqLen(vec3(ps[i_g] - ps[j_g])) > h * h) continue;
+        vec3 pij = vec3(ps[i_g] - ps[j_g]);
+        if (particles[j_g].t == FLUID) {
+            int j_f = gToF(j_g);
+            float jmass = 1.f / particles[j_g].w;
+
+            /* [MM13, Eq. 13] */
+            deltaP += spikyKernelGrad(pij, h) * (fluid->lambdas[i_f] + fluid->lambdas[j_f]);
+
+            /* vorticity confinement [MM13, Eq.16] */
+            vec3 pplus = (imass * vec3(ps[i_g]) + jmass * vec3(ps[j_g])) / (imass + jmass);
+            vec3 eta = pplus - vec3(ps[i_g]);
+            vec3 N = (sqLen(eta) > 0) ? normalize(eta) : vec3(0);  // [HLYK08, Eq. 7]
+            deltaP += fluid->relaxationEpsilon * cross(N, vec3(fluid->omegas[i_f]));
+
+            /* apply surface tension [AAT13] */
+            vec3 grad = AAI12TKernelNorm(pij, h);                                                          // [AAT13, Eq. 2]
+            vec3 cohesion = imass * jmass * grad * -fluid->f_cohesion;                                     // [AAT13, Eq. 1]
+            vec3 curveDiff = vec3(fluid->curvatureNormals[i_f] - fluid->curvatureNormals[j_f]);
+            vec3 curvature = imass * curveDiff * -fluid->f_curvature;                                      // [AAT13, Eq. 3]
+            float K = (2 * fluid->restDensity) / (fluid->densities[i_f] + fluid->densities[j_f]);          // [AAT13, Eq. 4]
+            deltaP += K * (cohesion + curvature);                                                          // [AAT13, Eq. 5]
+        } else if (particles[j_g].t == PORE) {
+            /* apply hair adhesion [AAT13, Eq. 6] */
+            int j_p = gToP(j_g);
+            deltaP += -fluid->f_adhesion * imass * (fluid->restDensity * hair->poreData[j_p].volume) * AAI12AdhesionKernelNorm(pij, h);
+        }
+    }
+    return imass * fluid->restDensityInv * deltaP;
+}
+
+// Computes the clumping force on porous particle `i_p` into `force`. Returns false if the particle is dry and applies no force
+bool CPUSimulation::computeClumpingForce(int i_p, vec3& force) {
+    int i_g = pToG(i_p);
+    const Rods::PoreData& pi = hair->poreData[i_p];
+    if (pi.density < 1e-9) return false;
+    float h = fluid->smoothingRadius;
+    const Rods::HairStrand& strandI = hair->hairStrands[getStrandV(pi.startIndex)];
+    float hairWeightI = (pi.startIndex - strandI.startVertexIdx + 1.f) / float(strandI.nVertices);
+    force = vec3(0);
+    forEachCandidate(ps[i_g], std::max(hair->clumpingRange, 1), PORE, [&](int j_g) {
+        if (sqLen(vec3(ps[i_g] - ps[j_g])) > h * h) return;
+        int j_p = gToP(j_g);
+        const Rods::PoreData& pj = hair->poreData[j_p];
+        if (getStrandV(pj.startIndex) == getStrandV(pi.startIndex)) return;
+        const Rods::HairStrand& strandJ = hair->hairStrands[getStrandV(pj.startIndex)];
+        float hairWeightJ = (pj.startIndex - strandJ.startVertexIdx + 1.f) / float(strandJ.nVertices);
+
+        if (pj.density < 1e-9) return;
+        float avgSat = (calculateSaturation(i_p) + calculateSaturation(j_p)) / 2;
+        float psi_i = fluid->restDensity * pi.volume * hairWeightI;
+        float psi_j = fluid->restDensity * pj.volume * hairWeightJ;
+        float U = 1 - std::min(1.f, pj.density * fluid->restDensityInv);
+        vec3 pij = vec3(ps[i_g] - ps[j_g]);
+        force += avgSat * U * psi_i * psi_j * AAI12TKernelNorm(pij, h);  // [Lin14, Eq. 11]
+    });
+    return true;
+}
+
+void CPUSimulation::predict(int i_g) {
+    int i_h = gToH(i_g);
+    Particle& p = particles[i_g];
+
+    if (p.t == HAIR) {
+        p.d = std::max(0.f, p.d - fluid->fluidMassDiffusionFactor);  // reset wetness
+
+        if (i_h == getRootVertex(i_h)) {
+            ps[i_g] = hair->headTrans * hair->hairStrands[getStrandV(i_h)].root;
+        } else {
+            ps[i_g] = p.x + p.v * stepDt;
+        }
+
+        if (i_h == getTailVertex(i_h)) return;
+        int j_h = toJ(i_h);
+        const Rods::Rod& rod = hair->rods[j_h];
+        quat u = rod.q + (0.5f * stepDt) * hair->qmul(rod.q, pureQuat(vec3(rod.v)));
+        hair->us[j_h] = normalize(u);
+    } else if (p.t == FLUID) {
+        ps[i_g] = clampToBounds(p.x + p.v * stepDt);
+    }
+}
+
+void CPUSimulation::updatePorousPositions(int i_p) {
+    const Rods::PoreData& pd = hair->poreData[i_p];
+    ps[pToG(i_p)] = ps[pd.startIndex] + (ps[pd.endIndex] - ps[pd.startIndex]) * pd.endStrength;
+}
+
+void CPUSimulation::updateVelocities(int i_g) {
+    Particle& p = particles[i_g];
+    ps[i_g] = clampToBounds(ps[i_g]);
+    if (p.t == HAIR) {
+        p.v = vec4(Util::clampV(hair->f_l_drag * vec3(ps[i_g] - p.x) / stepDt, vec3(-maxSpeed), vec3(maxSpeed)), 0);
+        p.x = ps[i_g] * ssSOR + p.x * (1 - ssSOR);
+        ps[i_g] = p.x;
+
+        int i_h = gToH(i_g);
+        if (i_h == getTailVertex(i_h)) return;
+        int j_h = toJ(i_h);
+        Rods::Rod& rod = hair->rods[j_h];
+        quat& u = hair->us[j_h];
+        u = normalize(u);
+        vec3 nv = hair->f_a_drag * Im((2.f * hair->qmul(conjugate(rod.q), u)) / stepDt);
+        rod.v = vec4(nv, 0);
+        rod.q = normalize(u * (btSOR / 2) + rod.q * (1 - (btSOR / 2)));
+    } else if (p.t == FLUID) {
+        p.v = vec4(Util::clampV(vec3(ps[i_g] - p.x) / stepDt, vec3(-maxSpeed), vec3(maxSpeed)), 0);
+        p.x = ps[i_g] * dnSOR + p.x * (1 - dnSOR);
+        ps[i_g] = p.x;
+    }
+}
+
+}  // namespace Sim
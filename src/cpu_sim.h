@@ -0,0 +1,119 @@
+#ifndef CPU_SIM_H
+#define CPU_SIM_H
+
+#include "common_sim.h"
+#include "spatialgrid.h"
+#include "threadpool.h"
+#include "hair.h"
+#include "fluid.h"
+
+using namespace CommonSim;
+namespace Sim {
+
+// CPU implementation of simulation.comp.
+// Every stage runs the same per-particle function as its GLSL counterpart, spread across all cores with a `ThreadPool`.
+// Stages that scatter into other particles on the GPU (viscosity, density, clumping) gather into a scratch buffer first
+// so that no two threads write to the same particle.
+class CPUSimulation {
+   public:
+    CPUSimulation(Rods::Hair* h, PBF::Fluid* f, SpatialGrid* g) : hair(h), fluid(f), grid(g) {}
+    ~CPUSimulation() {}
+
+    // Run every substep of a single tick. The grid must already be organised
+    void simulate();
+
+    // Run a single simulation stage over all of its particles
+    void dispatch(int stage);
+
+    // Move the pinned vertices and rods of every strand by the head rotation `delta`, one strand per task. See reorient.comp
+    void followHead(const mat4& delta);
+
+    ThreadPool pool;
+    HairSolver hairSolver = DISPATCH_SOLVER;
+    ChebyshevConfig chebyshev;
+    std::atomic<long long> candidatesVisited = 0;  // grid entries examined while building neighbour lists, for benchmarking
+    int listBuilds = 0;                            // number of times the neighbour lists were rebuilt
+    std::atomic<bool> listOverflowed = false;      // a neighbour list was too short for its neighbours
+
+   private:
+    /* Constraints */
+    void stretchAndShearConstraint(int i_h);
+    void bendAndTwistConstraint(int i_h);
+    void longRangeAttachment(int i_h);
+    void solveStrandDirect(int s);
+    vec3 densityConstraint(int i_f);
+
+    /* Neighbour lists */
+    bool checkNeighbourList(int i_fp);
+    void refreshNeighbourList(int i_fp, bool rebuild);
+
+    /* Type-specific functions */
+    void computePorousVolume(int i_p);
+    void computeDensity(int i_fp);
+    vec3 computeViscosity(int i_f);
+    void computeFluidAuxillaries(int i_f);
+    bool computeClumpingForce(int i_p, vec3& force);
+
+    /* Universal functions */
+    void applyExternalForces(int i_hf);
+    void predict(int i_g);
+    void updatePorousPositions(int i_p);
+    void updateVelocities(int i_g);
+    void resolveCollisions(int i_g);
+
+    /* Helpers */
+    float calculateSaturation(int i_p);
+    float calcFluidConstraint(int i_f);
+    vec3 calcFluidConstraintGrad(int j_g, vec3 spikyGrad);
+    vec3 darboux(int j_h);
+    float darbouxSign(int j_h);
+
+    // Call `fn(j_g)` for every particle of phase `phase` in the grid stencil around `p`, widened by `rings` - 1 cells
+    template <typename F>
+    void forEachCandidate(vec4 p, int rings, Phase phase, F&& fn) {
+        ivec3 lo, hi;
+        grid->stencilRange(p, rings, lo, hi);
+        for (int x = lo.x; x <= hi.x; ++x) {
+            for (int y = lo.y; y <= hi.y; ++y) {
+                for (int z = lo.z; z <= hi.z; ++z) {
+                    ivec2 r = SpatialGrid::phaseRange(grid->particleStartIndices[grid->flatten(ivec3(x, y, z))], phase);
+                    for (int s = r.x; s < r.y; ++s) {
+                        fn(grid->cellEntries[s]);
+                    }
+                }
+            }
+        }
+    }
+
+    /* Re-indexing functions. See simulation.comp */
+    int gToH(int i_g) { return i_g; }
+    int hToG(int i_h) { return i_h; }
+    int gToF(int i_g) { return i_g - hairParticleCount; }
+    int fToG(int i_f) { return i_f + hairParticleCount; }
+    int gToP(int i_g) { return i_g - hairParticleCount - fluidParticleCount; }
+    int pToG(int i_p) { return i_p + hairParticleCount + fluidParticleCount; }
+    int toJ(int i_h) { return i_h - particles[i_h].s; }
+    int toDarboux(int j_h) { return j_h - hair->rods[j_h].s; }
+    int getStrandV(int i_h) { return particles[i_h].s; }
+    int getStrandR(int j_h) { return hair->rods[j_h].s; }
+    int getRootVertex(int i) { return hair->hairStrands[getStrandV(i)].startVertexIdx; }
+    int getTailVertex(int i) { return hair->hairStrands[getStrandV(i)].endVertexIdx; }
+    int getTailRod(int j) { return hair->hairStrands[getStrandR(j)].endRodIdx; }
+
+    Rods::Hair* hair;
+    PBF::Fluid* fluid;
+    SpatialGrid* grid;
+
+    float stepDt = 0;           // substep delta time
+    mat3 inertiaInv{1};         // inverse of the hair inertia matrix
+    std::vector<vec3> scratch;  // per-particle results of gathering stages
+    std::vector<char> applied;  // whether `scratch` holds a result for a porous particle
+    std::vector<vec3> ssLambdas;  // XPBD multipliers of each rod's stretch and shear constraint over the substep
+    std::vector<vec3> btLambdas;  // XPBD multipliers of each Darboux vector's bend and twist constraint over the substep
+    float ssSOR = 1, btSOR = 2, dnSOR = 1;  // over-relaxation factors of this tick
+    std::vector<vec4> psIterates[2];  // previous and current Chebyshev iterates of the hair predicted positions
+    std::vector<quat> usIterates[2];  // previous and current Chebyshev iterates of the predicted orientations
+};
+}  // namespace Sim
+
+#endif /* CPU_SIM_H */
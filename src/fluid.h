@@ -5,6 +5,7 @@
 #include "cubemap.h"
 #include "input.h"
 #include "shader.h"
+#include "trace.h"
 #include "framebuffer.h"
 #include "sm.h"
 #include "staticmesh.h"
@@ -12,6 +13,8 @@
 #include "common_sim.h"
 
 #define USING_GPU
+#define MAX_NEIGHBOURS 48  // initial neighbour list capacity per particle. Grown if a list overflows. See `growNeighbourLists`
+#define PORE_NEIGHBOURS 16  // slots of each list kept for porous neighbours. Must match PORE_NEIGHBOURS in simulation.comp
 
 using namespace CommonSim;
 namespace Sim {
@@ -30,6 +33,7 @@ enum FluidRenderStage {
 
 class Fluid {
    public:
+    // Create the particles. Does not touch GL, so it may run on any thread
     Fluid(FluidConfig cfg) {
         auto& [n, pd, offs] = cfg;
         createParticles(n, pd, offs);
@@ -39,7 +43,10 @@ class Fluid {
         omegas.resize(nTotalParticles);
         curvatureNormals.resize(nTotalParticles);
         transforms.resize(nTotalParticles);
+    }
 
+    // Create the point sprite and pass shaders. Must run on the GL context thread
+    void createShaders() {
         spriteShader = new Shader("fluid", DIR("Shaders/sim/render/fluid/fluid.vert"), DIR("Shaders/sim/render/fluid/fluid.frag"));
         depthPassShader = new Shader("depth pass", DIR("Shaders/sim/render/fluid/fluid.vert"), DIR("Shaders/sim/render/fluid/depth_pass.frag"));
         thicknessPassShader = new Shader("depth pass", DIR("Shaders/sim/render/fluid/fluid.vert"), DIR("Shaders/sim/render/fluid/thickness_pass.frag"));
@@ -125,6 +132,63 @@ class Fluid {
         nTotalParticles = nFluidParticles + nBoundaryParticles;
     }
 
+    // Size the neighbour lists. Porous particles should be sampled by now
+    void initNeighbourLists() {
+        int n = fluidParticleCount + porousParticleCount;
+        neighbourStride = MAX_NEIGHBOURS;
+        neighbours.resize(n * neighbourStride);
+        neighbourKernels.resize(n * neighbourStride);
+        neighbourCounts.resize(n);
+        listPositions.resize(n);
+        neighboursStale = true;
+    }
+
+    // Widen every neighbour list by half after one overflowed, and rebuild them on the next substep. Recreates the list
+    // buffers if they exist, so they must be bound again
+    void growNeighbourLists() {
+        neighbourStride += neighbourStride / 2;
+        int n = neighbourCounts.size();
+        neighbours.assign(n * neighbourStride, 0);
+        neighbourKernels.assign(n * neighbourStride, vec4(0));
+        neighbourCounts.assign(n, ivec2(0));
+        neighboursStale = true;
+        if (neighboursBuffer) {
+            auto bf = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT | GL_DYNAMIC_STORAGE_BIT;
+            glDeleteBuffers(1, &neighboursBuffer);
+            glCreateBuffers(1, &neighboursBuffer);
+            glNamedBufferStorage(neighboursBuffer, sizeof(int) * neighbours.size(), neighbours.data(), bf);
+            glDeleteBuffers(1, &neighbourKernelsBuffer);
+            glCreateBuffers(1, &neighbourKernelsBuffer);
+            glNamedBufferStorage(neighbourKernelsBuffer, sizeof(vec4) * neighbourKernels.size(), neighbourKernels.data(), bf);
+            glNamedBufferSubData(neighbourCountsBuffer, 0, sizeof(ivec2) * neighbourCounts.size(), neighbourCounts.data());
+        }
+        printf("A neighbour list overflowed. Lists now hold %d neighbours\n", neighbourStride);
+    }
+
+    // Largest distance any fluid stage looks for neighbours
+    float interactionRadius() const {
+        return smoothingRadius + std::max(neighbourSkin, 0.f);
+    }
+
+    // How far a particle may move from where the neighbour lists were built before they are rebuilt.
+    // Half the skin, less the furthest a particle can travel during the rest of the substep
+    float neighbourRebuildDistance(float sdt) const {
+        return neighbourSkin / 2 - MAX_PARTICLE_SPEED * sdt;
+    }
+
+    // Should the neighbour lists be rebuilt on the next substep regardless of movement?
+    bool forceNeighbourRebuild(float sdt) {
+        if (smoothingRadius != listSmoothingRadius || neighbourSkin != listSkin) neighboursStale = true;
+        return neighboursStale || neighbourRebuildDistance(sdt) <= 0;
+    }
+
+    // Record that the neighbour lists were just rebuilt
+    void markNeighboursBuilt() {
+        neighboursStale = false;
+        listSmoothingRadius = smoothingRadius;
+        listSkin = neighbourSkin;
+    }
+
     void populateBuffers() {
         glCreateVertexArrays(1, &VAO);
         auto bf = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT | GL_DYNAMIC_STORAGE_BIT;
@@ -141,6 +205,22 @@ class Fluid {
         glCreateBuffers(1, &omegasBuffer);
         glNamedBufferStorage(omegasBuffer, sizeof(vec4) * omegas.size(), omegas.data(), bf);
 
+        glCreateBuffers(1, &neighboursBuffer);
+        glNamedBufferStorage(neighboursBuffer, sizeof(int) * neighbours.size(), neighbours.data(), bf);
+
+        glCreateBuffers(1, &neighbourCountsBuffer);
+        glNamedBufferStorage(neighbourCountsBuffer, sizeof(ivec2) * neighbourCounts.size(), neighbourCounts.data(), bf);
+
+        glCreateBuffers(1, &neighbourKernelsBuffer);
+        glNamedBufferStorage(neighbourKernelsBuffer, sizeof(vec4) * neighbourKernels.size(), neighbourKernels.data(), bf);
+
+        glCreateBuffers(1, &listPositionsBuffer);
+        glNamedBufferStorage(listPositionsBuffer, sizeof(vec4) * listPositions.size(), listPositions.data(), bf);
+
+        glCreateBuffers(1, &neighbourFlagsBuffer);
+        glNamedBufferStorage(neighbourFlagsBuffer, sizeof(int) * 2, nullptr, bf);
+        glClearNamedBufferData(neighbourFlagsBuffer, GL_R32I, GL_RED_INTEGER, GL_INT, nullptr);
+
         // load command buffer
         IndirectArrayDrawCommand* cmds = new IndirectArrayDrawCommand[1];
         unsigned int baseInstance = 0, baseVertex = 0;
@@ -330,15 +410,16 @@ class Fluid {
         float heightOfNearPlane = (float)abs(viewport[3] - viewport[1]) / (2 * tan(Util::rad(0.5 * SM::camera->FOV)));
         auto blur = [&](vec2 stride, int dimension, Framebuffer* src, Framebuffer* dst, float thresholdMult = 1, bool useOwnShader = false) {
             if (!useOwnShader) {
+                const BlurUniforms& u = blurUniformsOf(dst->quadShader);
                 dst->quadShader->use();
-                dst->quadShader->setFloat("particleRadius", particleRadius);
-                dst->quadShader->setVec2("stride", stride);
-                dst->quadShader->setInt("filterDim", dimension);
-                dst->quadShader->setInt("filterRadius", kernelHalfWidth);
-                dst->quadShader->setInt("maxFilterSize", maxKernelHalfWidth);
-                dst->quadShader->setFloat("nearPlaneHeight", heightOfNearPlane);
-                dst->quadShader->setFloat("thresholdRatio", thresholdRatio * thresholdMult);
-                dst->quadShader->setFloat("clampRatio", clampRatio);
+                u.particleRadius.set(particleRadius);
+                u.stride.set(stride);
+                u.filterDim.set(dimension);
+                u.filterRadius.set(kernelHalfWidth);
+                u.maxFilterSize.set(maxKernelHalfWidth);
+                u.nearPlaneHeight.set(heightOfNearPlane);
+                u.thresholdRatio.set(thresholdRatio * thresholdMult);
+                u.clampRatio.set(clampRatio);
             }
 
             dst->bind();
@@ -382,18 +463,28 @@ class Fluid {
     }
 
     void compositeTextures() {
-        compositionFBO->quadShader->use();
-        compositionFBO->quadShader->setFloat("particleRadius", particleRadius);
-        compositionFBO->quadShader->setMat4("proj", SM::camera->getPerspectiveMatrix());
-        compositionFBO->quadShader->setFloat("nearPlane", SM::camera->nearClipDist);
-        compositionFBO->quadShader->setFloat("farPlane", SM::camera->farClipDist);
-        compositionFBO->quadShader->setBool("showDiffuse", showDiffuseOnly);
-        compositionFBO->quadShader->setVec3("waterCol", waterColour);
-        compositionFBO->quadShader->setVec3("attenuationCol", attenuationColour);
-        compositionFBO->quadShader->rmv();
+        auto& u = compositionUniforms;
+        if (!u.proj.program) {
+            const Shader* s = compositionFBO->quadShader;
+            u.particleRadius = s->uniform<float>("particleRadius");
+            u.nearPlane = s->uniform<float>("nearPlane");
+            u.farPlane = s->uniform<float>("farPlane");
+            u.proj = s->uniform<mat4>("proj");
+            u.showDiffuse = s->uniform<bool>("showDiffuse");
+            u.waterCol = s->uniform<vec3>("waterCol");
+            u.attenuationCol = s->uniform<vec3>("attenuationCol");
+        }
+        u.particleRadius.set(particleRadius);
+        u.proj.set(SM::camera->getPerspectiveMatrix());
+        u.nearPlane.set(SM::camera->nearClipDist);
+        u.farPlane.set(SM::camera->farClipDist);
+        u.showDiffuse.set(showDiffuseOnly);
+        u.waterCol.set(waterColour);
+        u.attenuationCol.set(attenuationColour);
     }
 
     void render() {
+        TRACE_ZONE("Fluid::render");
         if (ticking && !renderWhileTicking && simulationTick < nextTick) return;
 
         /* 0: render either basic point sprites or particle velocities */
@@ -401,25 +492,35 @@ class Fluid {
         if (renderAtStage(VELOCITY)) return;
 
         /* 1: capture depth */
+        gpuTimers.begin("fluid depth");
         renderDepth();
+        gpuTimers.end();
         if (renderAtStage(DEPTH)) return;
 
         /* 2: capture thickness */
+        gpuTimers.begin("fluid thickness");
         renderThickness();
+        gpuTimers.end();
         if (renderAtStage(THICKNESS)) return;
 
         /* 3: smoothen depth and thickness textures */
+        gpuTimers.begin("fluid smoothing");
         smoothTextures();
+        gpuTimers.end();
         if (renderAtStage(SMOOTH_DEPTH)) return;
         if (renderAtStage(SMOOTH_THICKNESS)) return;
 
         /* 4: calculated normals from smoothed depth texture */
+        gpuTimers.begin("fluid normals");
         calcNormals();
+        gpuTimers.end();
         if (renderAtStage(NORMAL)) return;
 
         /* 5: apply diffuse lighting and volume */
+        gpuTimers.begin("fluid composition");
         compositeTextures();
         renderAtStage(COMPOSITION);
+        gpuTimers.end();
     }
 
     bool renderAtStage(FluidRenderStage stage) {
@@ -477,7 +578,48 @@ class Fluid {
     std::vector<vec4> curvatureNormals;
     std::vector<mat4> transforms;
 
+    /* Neighbour lists. Indexed by fluid/porous index, with `neighbourStride` slots per particle */
+    std::vector<int> neighbours;        // global indices of fluid, then porous, particles within smoothingRadius + neighbourSkin
+    std::vector<vec4> neighbourKernels; // spikyKernelGrad (xyz) and poly6Kernel (w) of each pair at the start of the substep
+    std::vector<ivec2> neighbourCounts; // number of fluid (x) and porous (y) neighbours
+    std::vector<vec4> listPositions;    // positions the lists were built at
+    int neighbourStride = MAX_NEIGHBOURS;  // slots of each list
+    bool neighboursStale = true;        // rebuild the lists on the next substep regardless of movement
+    float listSmoothingRadius = 0;      // smoothing radius the lists were built with
+    float listSkin = 0;                 // skin the lists were built with
+
     Shader *spriteShader, *simulationShader, *depthPassShader, *thicknessPassShader;
+
+    /* Uniform handles of the per-frame passes. Fetched on first use, once any deferred link has finished */
+    struct BlurUniforms {
+        UniformHandle<float> particleRadius, nearPlaneHeight, thresholdRatio, clampRatio;
+        UniformHandle<vec2> stride;
+        UniformHandle<int> filterDim, filterRadius, maxFilterSize;
+    };
+    struct CompositionUniforms {
+        UniformHandle<float> particleRadius, nearPlane, farPlane;
+        UniformHandle<mat4> proj;
+        UniformHandle<bool> showDiffuse;
+        UniformHandle<vec3> waterCol, attenuationCol;
+    };
+    std::unordered_map<const Shader*, BlurUniforms> blurUniforms;  // one per narrow-range filter program
+    CompositionUniforms compositionUniforms;
+
+    // Get the blur handles of `s`, fetching them the first time it is seen
+    const BlurUniforms& blurUniformsOf(const Shader* s) {
+        auto it = blurUniforms.find(s);
+        if (it != blurUniforms.end()) return it->second;
+        BlurUniforms& u = blurUniforms[s];
+        u.particleRadius = s->uniform<float>("particleRadius");
+        u.nearPlaneHeight = s->uniform<float>("nearPlaneHeight");
+        u.thresholdRatio = s->uniform<float>("thresholdRatio");
+        u.clampRatio = s->uniform<float>("clampRatio");
+        u.stride = s->uniform<vec2>("stride");
+        u.filterDim = s->uniform<int>("filterDim");
+        u.filterRadius = s->uniform<int>("filterRadius");
+        u.maxFilterSize = s->uniform<int>("maxFilterSize");
+        return u;
+    }
     Framebuffer *depthFBO, *thicknessFBO1, *thicknessFBO2, *blurFBO, *normalsFBO, *tempBlur1FBO, *tempBlur2FBO, *compositionFBO, *envFBO;
     StaticMesh* mesh;
     unsigned VAO = 0;
@@ -486,6 +628,11 @@ class Fluid {
     unsigned curvatureNormalsBuffer = 0;
     unsigned deltasBuffer = 0;
     unsigned omegasBuffer = 0;
+    unsigned neighboursBuffer = 0;
+    unsigned neighbourCountsBuffer = 0;
+    unsigned neighbourKernelsBuffer = 0;
+    unsigned listPositionsBuffer = 0;
+    unsigned neighbourFlagsBuffer = 0;
     unsigned commandBuffer = 0;
     const float thicknessInvScale = 4;  // how much to scale the thickness map down by
 
@@ -497,11 +644,13 @@ class Fluid {
     float relaxationEpsilon = 1e-2f;
     float SOR = 1.4;
     float k = 1;  // stiffness
+    float alpha = 4e-7f;  // XPBD compliance. Matches relaxationEpsilon at the default substep size
     float f_cohesion = .5f;
     float f_curvature = 6e-4f;
     float f_viscosity = .3f;
     float f_adhesion = 8.f;
     float fluidMassDiffusionFactor = 1;
+    float neighbourSkin = 0.6f;  // extra radius kept in the neighbour lists so they survive several substeps. 0 rebuilds every substep
 
     /* Rendering */
     bool showOutline = true;
@@ -4,6 +4,7 @@
 #include "util.h"
 #include "sm.h"
 #include "shader.h"
+#include "trace.h"
 
 #include <glad/gl.h>
 
@@ -56,6 +57,7 @@ class Framebuffer {
     Framebuffer() { name = "NewDefaultFrameBuffer"; }
     Framebuffer(std::string nm, std::string vertexShaderPath, std::string fragmentShaderPath, int fboWidth, int fboHeight) {
         name = nm;
+        TRACE_ZONE("Framebuffer::Framebuffer", name.c_str());
         quadShader = new Shader(name + "_shader", vertexShaderPath, fragmentShaderPath);
         width = fboWidth;
         height = fboHeight;
@@ -64,6 +66,7 @@ class Framebuffer {
     ~Framebuffer() {}
 
     void populateBuffers() {
+        TRACE_ZONE("Framebuffer::populateBuffers", name.c_str());
         glCreateFramebuffers(1, &FBO);
         glCreateVertexArrays(1, &quadVAO);
         glBindVertexArray(quadVAO);
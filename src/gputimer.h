@@ -0,0 +1,141 @@
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+
+#include <glad/gl.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#define GPU_TIMER_FRAMES 4  // frames of queries in flight. A frame's results are read back this many frames after it was issued
+
+// Measures how long the GPU spends in named sections of each frame using GL timestamp queries.
+// Results are read back `GPU_TIMER_FRAMES` frames later, and only once the GPU has made them available, so timing never
+// stalls the pipeline. A frame whose results are still not ready when its queries are needed again is dropped.
+// A section timed several times in one frame (e.g. a stage dispatched every substep) is summed.
+class GPUTimers {
+   public:
+    struct Section {
+        std::string name;
+        double last = 0;     // milliseconds in the most recent frame read back
+        double average = 0;  // rolling average in milliseconds
+    };
+
+    GPUTimers() {}
+    ~GPUTimers() {
+        stopCSV();
+    }
+
+    // Start timing section `name`. Sections may not nest
+    void begin(const char* name) {
+        if (!enabled) return;
+        Frame& f = frames[current];
+        if (f.used * 2 == (int)f.queries.size()) {
+            f.queries.resize(f.queries.size() + 2);
+            glGenQueries(2, &f.queries[f.used * 2]);
+            f.sections.push_back(0);
+        }
+        f.sections[f.used] = sectionIndex(name);
+        glQueryCounter(f.queries[f.used * 2], GL_TIMESTAMP);
+        open = true;
+    }
+
+    // Stop timing the section started by the last `begin`
+    void end() {
+        if (!enabled || !open) return;
+        Frame& f = frames[current];
+        glQueryCounter(f.queries[f.used * 2 + 1], GL_TIMESTAMP);
+        f.used++;
+        open = false;
+    }
+
+    // Finish the current frame, tagged with `tick`. Reads back the oldest frame if its results are ready
+    void endFrame(int tick) {
+        frames[current].tick = tick;
+        current = (current + 1) % GPU_TIMER_FRAMES;
+        resolve(frames[current]);
+        frames[current].used = 0;
+    }
+
+    // Read back every frame still in flight, oldest first. Call after `glFinish` so that all results are ready
+    void flush() {
+        for (int i = 0; i < GPU_TIMER_FRAMES; ++i) {
+            current = (current + 1) % GPU_TIMER_FRAMES;
+            resolve(frames[current]);
+            frames[current].used = 0;
+        }
+    }
+
+    // Stream every frame's section times to `path` as `tick,section,ms` rows
+    bool startCSV(const char* path) {
+        stopCSV();
+        csv = fopen(path, "w");
+        if (!csv) {
+            fprintf(stderr, "ERROR: could not open %s for GPU timings\n", path);
+            return false;
+        }
+        fprintf(csv, "tick,section,ms\n");
+        return true;
+    }
+
+    void stopCSV() {
+        if (csv) fclose(csv);
+        csv = nullptr;
+    }
+
+    bool streamingCSV() const { return csv != nullptr; }
+
+    bool enabled = true;
+    float smoothing = 0.05f;  // weight of the newest frame in each rolling average
+    std::vector<Section> sections;
+
+   private:
+    struct Frame {
+        std::vector<unsigned> queries;  // start and end timestamp of each timed section
+        std::vector<int> sections;      // section timed by each pair of queries
+        int used = 0;                   // pairs of queries issued this frame
+        int tick = 0;
+    };
+
+    int sectionIndex(const char* name) {
+        auto it = sectionIds.find(name);
+        if (it != sectionIds.end()) return it->second;
+        sectionIds[name] = sections.size();
+        sections.push_back({name});
+        totals.push_back(0);
+        return sections.size() - 1;
+    }
+
+    // Accumulate the results of frame `f`, if the GPU has finished it
+    void resolve(Frame& f) {
+        if (f.used == 0) return;
+        int available = 0;
+        glGetQueryObjectiv(f.queries[f.used * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;
+
+        std::fill(totals.begin(), totals.end(), 0.0);
+        for (int i = 0; i < f.used; ++i) {
+            GLuint64 t0, t1;
+            glGetQueryObjectui64v(f.queries[i * 2], GL_QUERY_RESULT, &t0);
+            glGetQueryObjectui64v(f.queries[i * 2 + 1], GL_QUERY_RESULT, &t1);
+            totals[f.sections[i]] += (t1 - t0) / 1e6;
+        }
+        for (int s = 0; s < (int)sections.size(); ++s) {
+            Section& sec = sections[s];
+            sec.last = totals[s];
+            sec.average = sec.average == 0 ? totals[s] : sec.average + (totals[s] - sec.average) * smoothing;
+            if (csv) fprintf(csv, "%d,%s,%.4f\n", f.tick, sec.name.c_str(), totals[s]);
+        }
+    }
+
+    Frame frames[GPU_TIMER_FRAMES];
+    int current = 0;
+    bool open = false;  // is a section being timed?
+    std::map<std::string, int> sectionIds;
+    std::vector<double> totals;  // per-section scratch for `resolve`
+    FILE* csv = nullptr;
+};
+
+#endif /* GPUTIMER_H */
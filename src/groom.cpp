@@ -0,0 +1,133 @@
+#include "groom.h"
+
+#include <cstring>
+#include <fstream>
+
+#include "trace.h"
+
+namespace Sim {
+namespace Rods {
+
+// Header of a cyHair file
+struct CyHairHeader {
+    char signature[4];  // "HAIR"
+    uint32_t hairCount;
+    uint32_t pointCount;
+    uint32_t arrays;       // CYHAIR_*_BIT flags of the arrays in the file
+    uint32_t dSegments;    // segments of every hair if there is no segments array
+    float dThickness;
+    float dTransparency;
+    float dColour[3];
+    char info[88];
+};
+static_assert(sizeof(CyHairHeader) == 128, "CyHairHeader must match the cyHair file header");
+
+#define CYHAIR_SEGMENTS_BIT 1
+#define CYHAIR_POINTS_BIT 2
+
+bool Groom::load(const std::string& path) {
+    TRACE_ZONE("Groom::load", path.c_str());
+    strands.clear();
+    nPoints = 0;
+    if (!file.open(path)) {
+        fprintf(stderr, "ERROR: reading groom %s\n", path.c_str());
+        return false;
+    }
+    bool cyHair = path.size() >= 5 && path.compare(path.size() - 5, 5, ".hair") == 0;
+    if (!(cyHair ? loadCyHair() : loadCompact())) {
+        fprintf(stderr, "ERROR: %s is not a valid %s groom\n", path.c_str(), cyHair ? "cyHair" : "compact");
+        file.close();
+        strands.clear();
+        return false;
+    }
+    if (strands.empty()) {
+        fprintf(stderr, "ERROR: groom %s has no strands with at least 2 points\n", path.c_str());
+        file.close();
+        return false;
+    }
+    printf("Loaded groom \"%s\": %d strands, %d points\n", path.c_str(), strandCount(), nPoints);
+    return true;
+}
+
+bool Groom::loadCompact() {
+    const unsigned char* data = file.data();
+    size_t size = file.size();
+    GroomHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != GROOM_MAGIC || header.version != GROOM_VERSION) return false;
+    size_t countsSize = sizeof(uint32_t) * header.nStrands;
+    if (size - sizeof(header) < countsSize || (size - sizeof(header) - countsSize) / 12 < header.nPoints) return false;
+
+    const uint32_t* counts = (const uint32_t*)(data + sizeof(header));
+    points = data + sizeof(header) + countsSize;
+    zUp = false;
+    strands.reserve(header.nStrands);
+    uint64_t first = 0;
+    for (uint32_t s = 0; s < header.nStrands; ++s) {
+        if (first + counts[s] > header.nPoints) return false;
+        if (counts[s] >= 2) {
+            strands.push_back({(int)first, (int)counts[s]});
+            nPoints += counts[s];
+        }
+        first += counts[s];
+    }
+    return true;
+}
+
+bool Groom::loadCyHair() {
+    const unsigned char* data = file.data();
+    size_t size = file.size();
+    CyHairHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.signature, "HAIR", 4) != 0 || !(header.arrays & CYHAIR_POINTS_BIT)) return false;
+
+    size_t offset = sizeof(header);
+    const unsigned char* segments = nullptr;
+    if (header.arrays & CYHAIR_SEGMENTS_BIT) {
+        segments = data + offset;
+        offset += sizeof(uint16_t) * header.hairCount;
+    }
+    if (size < offset || (size - offset) / 12 < header.pointCount) return false;
+    points = data + offset;
+    zUp = true;
+
+    strands.reserve(header.hairCount);
+    uint64_t first = 0;
+    for (uint32_t s = 0; s < header.hairCount; ++s) {
+        uint64_t n = (uint64_t)header.dSegments + 1;
+        if (segments) {
+            uint16_t segs;
+            memcpy(&segs, segments + sizeof(segs) * s, sizeof(segs));
+            n = segs + 1;
+        }
+        if (first + n > header.pointCount) return false;
+        if (n >= 2) {
+            strands.push_back({(int)first, (int)n});
+            nPoints += n;
+        }
+        first += n;
+    }
+    return true;
+}
+
+bool Groom::save(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+    GroomHeader header = {GROOM_MAGIC, GROOM_VERSION, (uint32_t)strandCount(), (uint32_t)nPoints};
+    out.write((const char*)&header, sizeof(header));
+    for (const auto& [first, count] : strands) {
+        uint32_t n = count;
+        out.write((const char*)&n, sizeof(n));
+    }
+    for (int s = 0; s < strandCount(); ++s) {
+        for (int i = 0; i < pointCount(s); ++i) {
+            vec3 p = point(s, i);
+            out.write((const char*)&p, sizeof(p));
+        }
+    }
+    return (bool)out;
+}
+}  // namespace Rods
+}  // namespace Sim
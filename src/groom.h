@@ -0,0 +1,64 @@
+#ifndef GROOM_H
+#define GROOM_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mappedfile.h"
+#include "util.h"
+
+#define GROOM_MAGIC 0x4d4f5247  // "GROM"
+#define GROOM_VERSION 1
+
+namespace Sim {
+namespace Rods {
+
+// Header of a compact groom file. Followed by the point count of each strand (uint32), then the points of every strand
+// in order (3 floats each, root first, y up, in the head's model space)
+struct GroomHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nStrands;
+    uint32_t nPoints;
+};
+
+// Hair strands read from a groom file as polylines of points. Supports the compact groom format above and the cyHair
+// `.hair` format (http://www.cemyuksel.com/research/hairmodels/). The file is memory-mapped and points are read straight
+// from the mapping, so the groom must outlive any `Hair` being built from it
+class Groom {
+   public:
+    // Map the groom at `path`, read as cyHair if it ends in ".hair". Strands with fewer than 2 points are dropped.
+    // Fails if no strand is left
+    bool load(const std::string& path);
+
+    // Write the groom to `path` in the compact format
+    bool save(const std::string& path) const;
+
+    int strandCount() const { return strands.size(); }
+    int pointCount(int s) const { return strands[s].second; }
+    int totalPointCount() const { return nPoints; }
+
+    // Point `i` of strand `s`, y up
+    vec3 point(int s, int i) const {
+        float p[3];
+        memcpy(p, points + 12 * ((size_t)strands[s].first + i), sizeof(p));  // cyHair points need not be aligned
+        return zUp ? vec3(p[0], p[2], -p[1]) : vec3(p[0], p[1], p[2]);
+    }
+
+   private:
+    bool loadCompact();
+    bool loadCyHair();
+
+    MappedFile file;
+    const unsigned char* points = nullptr;  // first point in the mapping
+    std::vector<std::pair<int, int>> strands;  // first point and point count of each strand kept
+    int nPoints = 0;                           // points in kept strands
+    bool zUp = false;                          // cyHair grooms are z up
+};
+}  // namespace Rods
+}  // namespace Sim
+
+#endif /* GROOM_H */
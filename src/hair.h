@@ -1,11 +1,15 @@
 #ifndef HAIR_H
 #define HAIR_H
 
+#include <cfloat>
+#include <climits>
 #include <execution>
 #include <deque>
 #include <queue>
+#include <unordered_map>
 
 #define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/component_wise.hpp>
 #include <glm/gtx/matrix_cross_product.hpp>
 #include <glm/gtx/matrix_operation.hpp>
 
@@ -14,7 +18,10 @@
 #include "util.h"
 #include "input.h"
 #include "shader.h"
+#include "trace.h"
 #include "common_sim.h"
+#include "groom.h"
+#include "threadpool.h"
 
 #define USE_GPU
 
@@ -69,19 +76,23 @@ struct HairStrand {
     int pd = 0;  // padding
 };
 
+#define STRAND_GROUP_VERTICES 256  // most vertices in a strand group. Must match GROUP_VERTICES in strands.comp
+#define MAX_DIRECT_RODS 31         // most rods in a strand for the GPU direct solver. Must match MAX_DIRECT_RODS in direct.comp
+#define DIRECT_LOCAL_SIZE 64       // strands per direct solver workgroup. Must match LOCAL_SIZE in direct.comp
+#define REORIENT_LOCAL_SIZE 64     // strands per reorientation workgroup. Must match LOCAL_SIZE in reorient.comp
+
+// How a render strand is interpolated from the guide strands. See interpolate.comp
+struct RenderStrandWeights {
+    ivec4 guides;  // guides blended, the first being the one the strand clumps to. w unused
+    vec4 weights;  // weight of each guide. w unused
+};
+
 /* ----- Global variables ----- */
 
 class Hair {
    public:
+    // Generate the strands. Does not touch GL, so it may run on any thread
     Hair(std::vector<HairConfig> configs) {
-        shader = new Shader("hair",
-                            {
-                                {DIR("Shaders/sim/render/hair/hair.vert"), GL_VERTEX_SHADER},
-                                {DIR("Shaders/sim/render/hair/hair.frag"), GL_FRAGMENT_SHADER},
-                                {DIR("Shaders/sim/render/hair/hair.tesc"), GL_TESS_CONTROL_SHADER},
-                                {DIR("Shaders/sim/render/hair/hair.tese"), GL_TESS_EVALUATION_SHADER},
-                            });
-
         numStrands = configs.size();
         int vStart = 0;
         int rStart = 0;
@@ -104,8 +115,164 @@ class Hair {
         nTotalVertices = vStart;
         nTotalRods = rStart;
     }
+
+    // Build the strands of `groom`. Every array is sized up front and then filled one strand per task in parallel,
+    // reading the points straight from the groom's mapping. Does not touch GL, so it may run on any thread
+    Hair(const Groom& groom) {
+        TRACE_ZONE("Hair::Hair", "groom");
+        numStrands = groom.strandCount();
+        hairStrands.reserve(numStrands);
+        indexCounts.resize(numStrands);
+        std::vector<int> indexStarts(numStrands + 1, 0);
+        int vStart = 0;
+        int rStart = 0;
+        for (int i = 0; i < numStrands; ++i) {
+            int nV = groom.pointCount(i);
+            int nR = nV - 1;
+            hairStrands.push_back(HairStrand(
+                nV, vStart, vStart + nV - 1,
+                nR, rStart, rStart + nR - 1,
+                0, vec4(groom.point(i, 0), 1)));
+            indexCounts[i] = std::min(nV, 4) + 4 * std::max(nV - 4, 0);  // see `initialiseVertices`
+            indexStarts[i + 1] = indexStarts[i] + indexCounts[i];
+            vStart += nV;
+            rStart += nR;
+        }
+        nTotalVertices = vStart;
+        nTotalRods = rStart;
+
+        assert(particles.empty() && "hair particles must come first");
+        particles.resize(nTotalVertices, Particle(vec3(0), vec3(0), 1, HAIR));
+        ps.resize(nTotalVertices);
+        tetherLengths.resize(nTotalVertices);
+        indices.resize(indexStarts[numStrands]);
+        rods.resize(nTotalRods, Rod(quat(1, 0, 0, 0), vec3(0), 1));
+        us.resize(nTotalRods);
+        d0s.resize(nTotalRods - numStrands);  // one fewer per strand than rods
+
+        loadPool().parallelFor(0, numStrands, [&](int i) { initialiseGroomStrand(groom, i, indexStarts[i]); }, 64);
+
+        float factor = (1 / 12.f) * (hairStrands[0].l0 * hairStrands[0].l0);
+        inertia = diagonal3x3(vec3(factor));
+    }
+
     ~Hair() {
-        deleteBuffers();
+        if (buffersSet) deleteBuffers();
+    }
+
+    // Create the render shader. Must run on the GL context thread
+    void createShaders() {
+        shader = new Shader("hair",
+                            {
+                                {DIR("Shaders/sim/render/hair/hair.vert"), GL_VERTEX_SHADER},
+                                {DIR("Shaders/sim/render/hair/hair.frag"), GL_FRAGMENT_SHADER},
+                                {DIR("Shaders/sim/render/hair/hair.tesc"), GL_TESS_CONTROL_SHADER},
+                                {DIR("Shaders/sim/render/hair/hair.tese"), GL_TESS_EVALUATION_SHADER},
+                            });
+        if (!renderStrands.empty())
+            interpolateKernel = new Shader("hair interpolation", {{DIR("Shaders/sim/render/hair/interpolate.comp"), GL_COMPUTE_SHADER}});
+    }
+
+    // Generate `perGuide` render strands around every strand, which then only serves as a guide. Render strands are not
+    // simulated; `render` rebuilds them from the guides each frame with interpolate.comp. Does not touch GL
+    void generateRenderStrands(int perGuide) {
+        TRACE_ZONE("Hair::generateRenderStrands");
+        if (perGuide <= 0 || numStrands < 3) return;
+        std::vector<ivec2> nearest = nearestGuides();
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uniform(0, 1);
+        int vStart = 0;
+        for (int g = 0; g < numStrands; ++g) {
+            const HairStrand& guide = hairStrands[g];
+            ivec4 guides = ivec4(g, nearest[g].x, nearest[g].y, 0);
+            for (int k = 0; k < perGuide; ++k) {
+                // uniform point in the triangle of the three guides' roots, scaled towards the first guide
+                float r1 = uniform(rng), r2 = uniform(rng);
+                if (r1 + r2 > 1) {
+                    r1 = 1 - r1;
+                    r2 = 1 - r2;
+                }
+                vec3 w = vec3(1 - (r1 + r2) * renderStrandSpread, r1 * renderStrandSpread, r2 * renderStrandSpread);
+                vec4 root = w.x * guide.root + w.y * hairStrands[guides.y].root + w.z * hairStrands[guides.z].root;
+
+                int r = renderStrands.size();
+                int nV = guide.nVertices;
+                renderWeights.push_back({guides, vec4(w, 0)});
+                renderStrands.push_back(HairStrand(nV, vStart, vStart + nV - 1, 0, 0, 0, guide.l0, root));
+                int prevIndexCount = renderIndices.size();
+                for (int i = 0; i < nV; ++i) {
+                    Particle part = Particle(vec3(0), vec3(0), 1, HAIR);
+                    part.s = r;
+                    renderParticles.push_back(part);
+                    if (i <= 3) {
+                        renderIndices.push_back(i);
+                    } else {
+                        renderIndices.insert(renderIndices.end(), {i - 3, i - 2, i - 1, i});
+                    }
+                }
+                renderIndexCounts.push_back(renderIndices.size() - prevIndexCount);
+                vStart += nV;
+            }
+        }
+        numGuideStrands = numStrands;
+        numRenderStrands = renderStrands.size();
+        printf("%d render strands interpolated from %d guide strands\n", numRenderStrands, numGuideStrands);
+    }
+
+    // Workers shared by every load-time pass, started on first use rather than once per call. Hairs are built one at a
+    // time, so the passes never overlap on the pool
+    static ThreadPool& loadPool() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // The two other strands whose roots are nearest to each strand's root. Roots are bucketed in a uniform grid of about
+    // one root per cell and each strand searches outwards from its cell until it has found two
+    std::vector<ivec2> nearestGuides() {
+        vec3 lo = vec3(hairStrands[0].root), hi = lo;
+        for (const auto& hs : hairStrands) {
+            lo = min(lo, vec3(hs.root));
+            hi = max(hi, vec3(hs.root));
+        }
+        float cell = std::max(compMax(hi - lo) / std::sqrt((float)numStrands), 1e-4f);  // roots lie on a surface
+        auto cellOf = [&](vec3 p) { return ivec3(floor((p - lo) / cell)); };
+        auto key = [](ivec3 c) { return (int64_t)c.x | ((int64_t)c.y << 21) | ((int64_t)c.z << 42); };
+        std::unordered_map<int64_t, std::vector<int>> cells;
+        for (int g = 0; g < numStrands; ++g) cells[key(cellOf(vec3(hairStrands[g].root)))].push_back(g);
+        ivec3 maxCell = cellOf(hi);
+
+        std::vector<ivec2> nearest(numStrands);
+        loadPool().parallelFor(0, numStrands, [&](int g) {
+            vec3 p = vec3(hairStrands[g].root);
+            ivec3 c = cellOf(p);
+            int best[2] = {-1, -1};
+            float bestD[2] = {FLT_MAX, FLT_MAX};
+            // one extra ring after the first hits, as a nearer root may sit in the next ring out
+            for (int r = 1, stopAt = INT_MAX; r <= stopAt && r <= compMax(maxCell) + 1; ++r) {
+                for (int x = c.x - r; x <= c.x + r; ++x)
+                    for (int y = c.y - r; y <= c.y + r; ++y)
+                        for (int z = c.z - r; z <= c.z + r; ++z) {
+                            ivec3 n = ivec3(x, y, z);
+                            if (r > 1 && compMax(abs(n - c)) < r) continue;  // searched in an earlier ring
+                            if (any(lessThan(n, ivec3(0))) || any(greaterThan(n, maxCell))) continue;
+                            auto it = cells.find(key(n));
+                            if (it == cells.end()) continue;
+                            for (int o : it->second) {
+                                if (o == g) continue;
+                                float d = distance2(p, vec3(hairStrands[o].root));
+                                if (d < bestD[0]) {
+                                    best[1] = best[0], bestD[1] = bestD[0];
+                                    best[0] = o, bestD[0] = d;
+                                } else if (d < bestD[1]) {
+                                    best[1] = o, bestD[1] = d;
+                                }
+                            }
+                        }
+                if (best[1] >= 0 && stopAt == INT_MAX) stopAt = r + 1;
+            }
+            nearest[g] = ivec2(best[0], best[1]);
+        }, 64);
+        return nearest;
     }
 
     void deleteBuffers() {
@@ -117,6 +284,20 @@ class Hair {
         glDeleteBuffers(1, &commandBuffer);
         // glDeleteBuffers(1, &commandBufferA);
         glDeleteBuffers(1, &VAO);
+        glDeleteBuffers(1, &strandGroupBuffer);
+        glDeleteBuffers(1, &ssLambdaBuffer);
+        glDeleteBuffers(1, &btLambdaBuffer);
+        glDeleteBuffers(1, &psIterateBuffer);
+        glDeleteBuffers(1, &usIterateBuffer);
+        glDeleteBuffers(1, &tetherLengthBuffer);
+        if (!renderStrands.empty()) {
+            glDeleteBuffers(1, &renderParticleBuffer);
+            glDeleteBuffers(1, &renderStrandBuffer);
+            glDeleteBuffers(1, &renderWeightsBuffer);
+            glDeleteBuffers(1, &renderCommandBuffer);
+            glDeleteBuffers(1, &renderEBO);
+            glDeleteVertexArrays(1, &renderVAO);
+        }
     }
 
     void populateBuffers() {
@@ -145,6 +326,21 @@ class Hair {
         glCreateBuffers(1, &poreDataBuffer);
         glNamedBufferStorage(poreDataBuffer, sizeof(PoreData) * poreData.size(), poreData.data(), bf);
 
+        glCreateBuffers(1, &tetherLengthBuffer);
+        glNamedBufferStorage(tetherLengthBuffer, sizeof(float) * tetherLengths.size(), tetherLengths.data(), GL_DYNAMIC_STORAGE_BIT);
+
+        // XPBD multipliers. Cleared at the start of every substep
+        glCreateBuffers(1, &ssLambdaBuffer);
+        glNamedBufferStorage(ssLambdaBuffer, sizeof(vec4) * std::max<size_t>(rods.size(), 1), nullptr, GL_DYNAMIC_STORAGE_BIT);
+        glCreateBuffers(1, &btLambdaBuffer);
+        glNamedBufferStorage(btLambdaBuffer, sizeof(vec4) * std::max<size_t>(d0s.size(), 1), nullptr, GL_DYNAMIC_STORAGE_BIT);
+
+        // previous and current Chebyshev iterates. Filled at the start of every constraint stage
+        glCreateBuffers(1, &psIterateBuffer);
+        glNamedBufferStorage(psIterateBuffer, sizeof(vec4) * 2 * std::max(hairParticleCount, 1), nullptr, 0);
+        glCreateBuffers(1, &usIterateBuffer);
+        glNamedBufferStorage(usIterateBuffer, sizeof(quat) * 2 * std::max<size_t>(us.size(), 1), nullptr, 0);
+
         // load command buffer
         // IndirectArrayDrawCommand* cmdsA = new IndirectArrayDrawCommand[numStrands];
         // unsigned int baseInstance = 0;
@@ -164,20 +360,103 @@ class Hair {
         // glNamedBufferStorage(commandBufferA, sizeof(IndirectArrayDrawCommand) * numStrands, &cmdsA[0], bf);
 
         // load command buffer
-        IndirectElementDrawCommand* cmds = new IndirectElementDrawCommand[numStrands];
+        glCreateBuffers(1, &commandBuffer);
+        fillCommandBuffer(commandBuffer, hairStrands, indexCounts);
+
+        buildStrandGroups();
+        directSolvable = fitsDirectSolver();
+        if (!strandGroups.empty()) {
+            glCreateBuffers(1, &strandGroupBuffer);
+            glNamedBufferStorage(strandGroupBuffer, sizeof(ivec4) * strandGroups.size(), strandGroups.data(), GL_DYNAMIC_STORAGE_BIT);
+        }
+
+        if (!renderStrands.empty()) {
+            glCreateVertexArrays(1, &renderVAO);
+            glCreateBuffers(1, &renderEBO);
+            glNamedBufferStorage(renderEBO, sizeof(renderIndices[0]) * renderIndices.size(), renderIndices.data(), GL_MAP_READ_BIT);
+            glVertexArrayElementBuffer(renderVAO, renderEBO);
+
+            glCreateBuffers(1, &renderParticleBuffer);
+            glNamedBufferStorage(renderParticleBuffer, sizeof(Particle) * renderParticles.size(), renderParticles.data(), bf);
+
+            glCreateBuffers(1, &renderStrandBuffer);
+            glNamedBufferStorage(renderStrandBuffer, sizeof(HairStrand) * renderStrands.size(), renderStrands.data(), GL_DYNAMIC_STORAGE_BIT);
+
+            glCreateBuffers(1, &renderWeightsBuffer);
+            glNamedBufferStorage(renderWeightsBuffer, sizeof(RenderStrandWeights) * renderWeights.size(), renderWeights.data(), GL_DYNAMIC_STORAGE_BIT);
+
+            glCreateBuffers(1, &renderCommandBuffer);
+            fillCommandBuffer(renderCommandBuffer, renderStrands, renderIndexCounts);
+        }
+
+        buffersSet = true;
+    }
+
+    // Pack consecutive strands into groups of at most STRAND_GROUP_VERTICES vertices for the strand solver.
+    // Leaves `strandGroups` empty if a strand is too long to fit in a group
+    void buildStrandGroups() {
+        strandGroups.clear();
+        ivec4 group = ivec4(0, 0, 0, 0);  // first strand, strand count, first vertex, vertex count
         for (int i = 0; i < numStrands; ++i) {
-            const auto& s = hairStrands[i];
-            cmds[i].indexCount = indexCounts[i];
+            int nV = hairStrands[i].nVertices;
+            if (nV > STRAND_GROUP_VERTICES) {
+                printf("Strand %d has %d vertices, more than the strand solver's %d. Only the dispatch solver can be used\n",
+                       i, nV, STRAND_GROUP_VERTICES);
+                strandGroups.clear();
+                return;
+            }
+            if (group.w + nV > STRAND_GROUP_VERTICES) {
+                strandGroups.push_back(group);
+                group = ivec4(i, 0, hairStrands[i].startVertexIdx, 0);
+            }
+            group.y++;
+            group.w += nV;
+        }
+        if (group.y > 0) strandGroups.push_back(group);
+    }
+
+    // Whether every strand has few enough rods for the GPU direct solver to hold it
+    bool fitsDirectSolver() const {
+        for (int i = 0; i < numStrands; ++i) {
+            if (hairStrands[i].nRods > MAX_DIRECT_RODS) {
+                printf("Strand %d has %d rods, more than the direct solver's %d. Only the CPU backend can solve it directly\n",
+                       i, hairStrands[i].nRods, MAX_DIRECT_RODS);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Store one indirect draw command per strand of `strands` in `buffer`. Each strand's indices follow the previous strand's
+    void fillCommandBuffer(unsigned buffer, const std::vector<HairStrand>& strands, const std::vector<int>& counts) {
+        std::vector<IndirectElementDrawCommand> cmds(strands.size());
+        unsigned int baseIndex = 0;
+        for (int i = 0; i < strands.size(); ++i) {
+            cmds[i].indexCount = counts[i];
             cmds[i].instanceCount = 1;  // 1 strand instance
-            cmds[i].baseIndex = 0;
-            cmds[i].baseVertex = s.startVertexIdx;
+            cmds[i].baseIndex = baseIndex;
+            cmds[i].baseVertex = strands[i].startVertexIdx;
             cmds[i].baseInstance = i;
+            baseIndex += counts[i];
         }
         // send command buffers to gpu
-        glCreateBuffers(1, &commandBuffer);
-        glNamedBufferStorage(commandBuffer, sizeof(IndirectElementDrawCommand) * numStrands, &cmds[0], bf);
+        glNamedBufferStorage(buffer, sizeof(IndirectElementDrawCommand) * cmds.size(), cmds.data(), GL_MAP_READ_BIT | GL_DYNAMIC_STORAGE_BIT);
+    }
 
-        buffersSet = true;
+    // Rebuild the render strands from the current guide positions
+    void interpolateRenderStrands() {
+        gpuTimers.begin("hair interpolation");
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, hairStrandBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, renderStrandBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, renderWeightsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, renderParticleBuffer);
+        interpolateKernel->use();
+        interpolateKernel->setInt("renderVertexCount", renderParticles.size());
+        interpolateKernel->setFloat("clumping", renderStrandClumping);
+        glDispatchCompute(renderParticles.size() / 256 + 1, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        gpuTimers.end();
     }
 
     // Hair vertices
@@ -231,6 +510,7 @@ class Hair {
             assert(abs(dd - l0) <= 1e-4f && "vertex distances don't match up!");
         }
         hairStrands[strandIdx].l0 = l0;
+        for (int i = 0; i < nV; ++i) tetherLengths.push_back(l0 * i);
 
         // move root to start position and offset all vertices by that distance (including the head's transform)
         vec4 offs = hairStrands[strandIdx].root - particles[vStart].x + headTrans[3];
@@ -266,8 +546,75 @@ class Hair {
         inertia = diagonal3x3(tensor);
     }
 
+    // Fill the vertices, indices, rods and rest Darboux vectors of groom strand `strandIdx` into their preallocated
+    // slots. The strand is resampled to equal segment lengths along its polyline, as the stretch constraint keeps
+    // every segment of a strand at one rest length
+    void initialiseGroomStrand(const Groom& groom, int strandIdx, int indexStart) {
+        HairStrand& strand = hairStrands[strandIdx];
+        int vStart = strand.startVertexIdx;
+        int rStart = strand.startRodIdx;
+        int nV = strand.nVertices;
+
+        float strandLen = 0;
+        for (int i = 0; i < nV - 1; ++i) strandLen += distance(groom.point(strandIdx, i), groom.point(strandIdx, i + 1));
+        float l0 = strandLen / (nV - 1);
+        strand.l0 = l0;
+
+        // walk the polyline, placing a vertex every `l0`
+        vec3 offs = vec3(headTrans[3]);
+        vec3 a = groom.point(strandIdx, 0);
+        vec3 b = groom.point(strandIdx, 1);
+        int seg = 0;
+        float segStart = 0;  // distance along the strand to `a`
+        for (int i = 0; i < nV; ++i) {
+            float target = i == nV - 1 ? strandLen : l0 * i;
+            float segLen = distance(a, b);
+            while (segStart + segLen < target && seg < nV - 2) {
+                segStart += segLen;
+                a = b;
+                b = groom.point(strandIdx, ++seg + 1);
+                segLen = distance(a, b);
+            }
+            vec3 p = segLen > 0 ? mix(a, b, std::clamp((target - segStart) / segLen, 0.f, 1.f)) : a;
+
+            Particle part = Particle(p + offs, vec3(0), i == 0 ? 0 : 1, HAIR);
+            part.s = strandIdx;
+            particles[vStart + i] = part;
+            ps[vStart + i] = vec4(p + offs, 0);
+            tetherLengths[vStart + i] = l0 * i;
+
+            if (i <= 3) {
+                indices[indexStart++] = i;
+            } else {
+                indices[indexStart++] = i - 3;
+                indices[indexStart++] = i - 2;
+                indices[indexStart++] = i - 1;
+                indices[indexStart++] = i;
+            }
+        }
+
+        // rods and rest Darboux vectors, as in `initialiseQuaternions`
+        vec3 from = e3;
+        for (int j = 0; j < nV - 1; ++j) {
+            vec3 to = vec3(particles[vStart + j + 1].x - particles[vStart + j].x);
+            quat q = quatFromVectors(from, to);
+            if (j != 0) q *= rods[rStart + j - 1].q;
+            Rod rod = Rod(q, vec3(0), j == 0 ? 0 : 1);
+            rod.s = strandIdx;
+            rods[rStart + j] = rod;
+            us[rStart + j] = q;
+            from = to;
+        }
+        for (int j = 0; j < nV - 2; ++j) {
+            d0s[rStart - strandIdx + j] = vec4(darboux(rStart + j), 0);
+        }
+    }
+
     void samplePorousParticles() {
         assert(fluidLoaded && "fluid not loaded"); // i had a reason for adding fluids before pores, but i don't remember it ¯\_(ツ)_/¯
+        particles.reserve(particles.size() + (size_t)(nTotalVertices - numStrands) * poreSamples);
+        ps.reserve(ps.size() + (size_t)(nTotalVertices - numStrands) * poreSamples);
+        poreData.reserve((size_t)(nTotalVertices - numStrands) * poreSamples);
         for (int s = 0; s < numStrands; ++s) {
             for (int i = hairStrands[s].startVertexIdx; i < hairStrands[s].startVertexIdx + hairStrands[s].nVertices - 1; ++i) {
                 vec3 a = vec3(particles[i].x);
@@ -319,30 +666,56 @@ class Hair {
 
     // Render the simulation
     void render() {
-        glBindVertexArray(VAO);
+        TRACE_ZONE("Hair::render");
+        bool interpolated = showRenderStrands && !renderStrands.empty();
+        if (interpolated) interpolateRenderStrands();
+        glBindVertexArray(interpolated ? renderVAO : VAO);
         shader->use();
 
         bindKernels();
-        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);  // rebind command buffer
+        if (interpolated) {
+            // the render shaders read the strands drawn from bindings 0 and 11
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, renderParticleBuffer);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, renderStrandBuffer);
+        }
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, interpolated ? renderCommandBuffer : commandBuffer);  // rebind command buffer
 
         int viewport[4];
         glGetIntegerv(GL_VIEWPORT, viewport);
         float heightOfNearPlane = (float)abs(viewport[3] - viewport[1]) / (2 * tan(Util::rad(0.5 * SM::camera->FOV)));
 
-        shader->setMat4("view", SM::camera->getViewMatrix());
-        shader->setMat4("proj", SM::camera->getPerspectiveMatrix());
-        shader->setVec3("viewPos", SM::camera->pos);
-        shader->setFloat("particleRadius", particleRadius);
-        shader->setFloat("nearPlaneHeight", heightOfNearPlane);
-        shader->setVec4("colour", hairColour);
-        shader->setVec3("pbrMaterial.albedo", vec3(hairColour));
-        shader->setFloat("pbrMaterial.metalness", metalness);
-        shader->setFloat("pbrMaterial.roughness", roughness);
-        shader->setFloat("fresnelPower", fresnelExponent);
-        shader->setVec3("headPos", vec3(headTrans[3]));
+        auto& u = renderUniforms;
+        if (!u.view.program) {
+            u.view = shader->uniform<mat4>("view");
+            u.proj = shader->uniform<mat4>("proj");
+            u.viewPos = shader->uniform<vec3>("viewPos");
+            u.particleRadius = shader->uniform<float>("particleRadius");
+            u.nearPlaneHeight = shader->uniform<float>("nearPlaneHeight");
+            u.colour = shader->uniform<vec4>("colour");
+            u.albedo = shader->uniform<vec3>("pbrMaterial.albedo");
+            u.metalness = shader->uniform<float>("pbrMaterial.metalness");
+            u.roughness = shader->uniform<float>("pbrMaterial.roughness");
+            u.fresnelPower = shader->uniform<float>("fresnelPower");
+            u.headPos = shader->uniform<vec3>("headPos");
+        }
+        u.view.set(SM::camera->getViewMatrix());
+        u.proj.set(SM::camera->getPerspectiveMatrix());
+        u.viewPos.set(SM::camera->pos);
+        u.particleRadius.set(particleRadius);
+        u.nearPlaneHeight.set(heightOfNearPlane);
+        u.colour.set(hairColour);
+        u.albedo.set(vec3(hairColour));
+        u.metalness.set(metalness);
+        u.roughness.set(roughness);
+        u.fresnelPower.set(fresnelExponent);
+        u.headPos.set(vec3(headTrans[3]));
         glPatchParameteri(GL_PATCH_VERTICES, 4); // catmull-rom splines use at 4 points: 2 controls, 2 line points
-        glMultiDrawElementsIndirect(GL_PATCHES, GL_UNSIGNED_INT, 0, numStrands, 0);
+        glMultiDrawElementsIndirect(GL_PATCHES, GL_UNSIGNED_INT, 0, interpolated ? numRenderStrands : numStrands, 0);
 
+        if (interpolated) {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleBuffer);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, hairStrandBuffer);
+        }
         glBindVertexArray(0);
     }
 
@@ -368,7 +741,15 @@ class Hair {
     int numGuideStrands = 0;   // number of guide strands
     int numRenderStrands = 0;  // number of render strands
     std::vector<HairStrand> hairStrands;
-    Shader* shader;
+    Shader* shader = nullptr;
+    // Handles of the uniforms `render` sets each frame. Fetched on first render, once any deferred link has finished
+    struct RenderUniforms {
+        UniformHandle<mat4> view, proj;
+        UniformHandle<vec3> viewPos, albedo, headPos;
+        UniformHandle<vec4> colour;
+        UniformHandle<float> particleRadius, nearPlaneHeight, metalness, roughness, fresnelPower;
+    } renderUniforms;
+    Shader* interpolateKernel = nullptr;  // builds the render strands from the guides
     Shader* simulationShader;
 
     /* --- Other --- */
@@ -383,6 +764,7 @@ class Hair {
     int nTotalVertices;  // number of vertices
     std::vector<int> indices;      // indices for each vertex
     std::vector<int> indexCounts;  // index counts for each strand
+    std::vector<float> tetherLengths;  // rest distance from each vertex to its root, measured along the strand
     
     /* Pores */
     std::vector<PoreData> poreData;
@@ -393,6 +775,17 @@ class Hair {
     std::vector<vec4> d0s;  // rest darboux vectors
     int nTotalRods;         // number of quaternions/rods
     
+    /* Strand solver */
+    std::vector<ivec4> strandGroups;  // first strand, strand count, first vertex, vertex count. See `buildStrandGroups`
+    bool directSolvable = false;      // whether the GPU direct solver can be used. See `fitsDirectSolver`
+
+    /* Render strands. Empty unless `generateRenderStrands` was called */
+    std::vector<HairStrand> renderStrands;
+    std::vector<RenderStrandWeights> renderWeights;
+    std::vector<Particle> renderParticles;  // positions are written by interpolate.comp
+    std::vector<int> renderIndices;
+    std::vector<int> renderIndexCounts;
+
     /* --- Rendering buffers --- */
     unsigned VAO = 0;
     unsigned EBO = 0;
@@ -403,13 +796,29 @@ class Hair {
     unsigned poreDataBuffer = 0;
     // unsigned commandBufferA = 0;
     unsigned commandBuffer = 0;
+    unsigned strandGroupBuffer = 0;
+    unsigned ssLambdaBuffer = 0;  // XPBD stretch and shear multipliers, one per rod
+    unsigned btLambdaBuffer = 0;  // XPBD bend and twist multipliers, one per Darboux vector
+    unsigned psIterateBuffer = 0;  // Chebyshev iterates of the hair predicted positions. See chebyshev.comp
+    unsigned usIterateBuffer = 0;  // Chebyshev iterates of the predicted orientations
+    unsigned tetherLengthBuffer = 0;
+    unsigned renderVAO = 0;
+    unsigned renderEBO = 0;
+    unsigned renderParticleBuffer = 0;
+    unsigned renderStrandBuffer = 0;
+    unsigned renderWeightsBuffer = 0;
+    unsigned renderCommandBuffer = 0;
     bool buffersSet = false;
 
     /* Constraints and Stiffnesses */
     float ss_k = 1;        // stretch and shear stiffness coefficient
+    float ss_alpha = 0;    // stretch and shear XPBD compliance
+    float bt_alpha = 0;    // bend and twist XPBD compliance
     float bt_k = 1;        // bend and twist stiffness coefficient
     float ss_SOR = 1.36f;  // see [UPP14]
     float bt_SOR = 3.f;    // see [UPP14]
+    bool useTethers = true;  // long range attachments [KCMF12]
+    float tetherSlack = 1;   // multiple of the rest distance a vertex may move from its root
 
     /* Physics */
     float f_l_drag = 0.98f;  // vertex air resistance
@@ -429,8 +838,11 @@ class Hair {
     float strandLength = 4;  // length of a strand
     int nCurls = 4;          // number of curls in a strand
     int poreSamples = 1;
+    float renderStrandSpread = 0.5f;    // how far render strands spread from their guide towards its neighbours (0-1)
+    float renderStrandClumping = 0.5f;  // how strongly render strands clump to their guide at the tip (0-1)
 
     /* ----- Settings ----- */
+    bool showRenderStrands = true;  // draw the render strands instead of the guides, if there are any
     bool ssC = true;
     bool btC = true;
     bool showLines = true;
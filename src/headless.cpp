@@ -0,0 +1,171 @@
+#include <glad/gl.h>
+#include <GLFW/glfw3.h>
+
+#include <cstdio>
+#include <cstring>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
+
+#include "staticmesh.h"
+#include "simulation.h"
+
+// Batch simulation runner. Builds the same scene as `main` and steps it as fast as possible without rendering.
+// usage: headless [--cpu | --gpu] [--ticks N] [--fluid N] [--sort N] [--stencil 27 | 8] [--timings FILE] [--trace FILE] [--groom FILE] [--hair-solver dispatch | strand | direct] [--xpbd] [--chebyshev] [--no-tethers] [--no-shader-cache]
+//  --cpu       run on the CPU backend. No window or GL context is created (default)
+//  --gpu       run on the GPU backend. Creates a hidden window for its GL context
+//  --ticks N   number of simulation ticks to run (default 1000)
+//  --fluid N   number of fluid particles (default 20000)
+//  --sort N    sort fluid particles into Z-order every N ticks (default 0, off)
+//  --stencil S grid cells searched for neighbours: 27 cells at h, or 8 cells at 2h (default 27)
+//  --timings F time each simulation stage on the GPU, writing the times per tick to CSV file F and printing their
+//              averages (GPU backend only). Stage timers are off without it
+//  --trace F   write a Chrome trace of the CPU timeline to F
+//  --groom F   load the hair strands from groom file F (compact groom or cyHair .hair) instead of generating them
+//  --hair-solver S  solve the hair constraints with the dispatch, strand or direct solver (default strand). The CPU
+//                   backend runs the strand solver as the dispatch solver
+//  --xpbd      solve the constraints with XPBD compliance instead of stiffness and SOR
+//  --chebyshev  accelerate the hair constraint iterations with Chebyshev extrapolation
+//  --no-tethers  disable the long range attachments from each hair root
+//  --no-shader-cache  compile every program from source instead of loading cached binaries
+
+/* Scene */
+#define MESH_LARGE_HEAD "largehead.gltf"
+const vec3 headStartPos = vec3(150, 6, 150);
+
+// Generate one hair strand per upward-facing vertex of `mesh_file_name`, as in `main`
+HairConfigs loadHairConfigs(std::string mesh_file_name) {
+    HairConfigs hs;
+    std::string rpath = MODELPATH(mesh_file_name) + mesh_file_name;
+    const aiScene* scene = aiImportFile(rpath.c_str(), AI_LOAD_FLAGS);
+    if (!scene) {
+        fprintf(stderr, "ERROR: reading mesh %s\n%s", rpath.c_str(), aiGetErrorString());
+        return hs;
+    }
+    for (unsigned m = 0; m < scene->mNumMeshes; ++m) {
+        const aiMesh* am = scene->mMeshes[m];
+        for (unsigned i = 0; i < am->mNumVertices; ++i) {
+            const aiVector3D& p = am->mVertices[i];
+            const aiVector3D& n = am->mNormals ? am->mNormals[i] : aiVector3D(0.0f, 1.0f, 0.0f);
+            if (p.y >= 0) hs.push_back({15, vec4(p.x, p.y, p.z, 1), vec3(n.x, n.y, n.z)});
+        }
+    }
+    aiReleaseImport(scene);
+    return hs;
+}
+
+// Create a hidden window so the GPU backend has a GL 4.6 context
+GLFWwindow* createHiddenContext() {
+    if (!glfwInit()) return nullptr;
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(1, 1, "Real-Time Wet Hair (headless)", NULL, NULL);
+    if (!window) return nullptr;
+    glfwMakeContextCurrent(window);
+    if (gladLoadGL(glfwGetProcAddress) == 0) return nullptr;
+    return window;
+}
+
+int main(int argc, char const* argv[]) {
+    SimulationBackend backend = CPU_BACKEND;
+    int ticks = 1000;
+    int nFluid = 20000;
+    int sortInterval = 0;
+    GridStencil stencil = STENCIL_27;
+    const char* timingsPath = nullptr;
+    const char* tracePath = nullptr;
+    const char* groomPath = nullptr;
+    HairSolver hairSolver = STRAND_SOLVER;
+    bool chebyshev = false;
+    bool tethers = true;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--cpu")) backend = CPU_BACKEND;
+        else if (!strcmp(argv[i], "--gpu")) backend = GPU_BACKEND;
+        else if (!strcmp(argv[i], "--ticks") && i + 1 < argc) ticks = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--fluid") && i + 1 < argc) nFluid = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--sort") && i + 1 < argc) sortInterval = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stencil") && i + 1 < argc) stencil = atoi(argv[++i]) == 8 ? STENCIL_8 : STENCIL_27;
+        else if (!strcmp(argv[i], "--timings") && i + 1 < argc) timingsPath = argv[++i];
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc) tracePath = argv[++i];
+        else if (!strcmp(argv[i], "--groom") && i + 1 < argc) groomPath = argv[++i];
+        else if (!strcmp(argv[i], "--hair-solver") && i + 1 < argc) {
+            const char* name = argv[++i];
+            hairSolver = !strcmp(name, "dispatch") ? DISPATCH_SOLVER : !strcmp(name, "direct") ? DIRECT_SOLVER : STRAND_SOLVER;
+        }
+        else if (!strcmp(argv[i], "--xpbd")) CommonSim::useXPBD = true;
+        else if (!strcmp(argv[i], "--chebyshev")) chebyshev = true;
+        else if (!strcmp(argv[i], "--no-tethers")) tethers = false;
+        else if (!strcmp(argv[i], "--no-shader-cache")) Shader::useProgramCache = false;
+        else {
+            fprintf(stderr, "usage: %s [--cpu | --gpu] [--ticks N] [--fluid N] [--sort N] [--stencil 27 | 8] [--timings FILE] [--trace FILE] [--groom FILE] [--hair-solver dispatch | strand | direct] [--xpbd] [--chebyshev] [--no-tethers] [--no-shader-cache]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    CommonSim::headless = true;
+    Trace::enabled = tracePath != nullptr;
+    Trace::setThreadName("main");
+    GLFWwindow* window = nullptr;
+    if (backend == GPU_BACKEND) {
+        window = createHiddenContext();
+        if (!window) {
+            printf("Failed to create an OpenGL 4.6 context\n");
+            glfwTerminate();
+            return -1;
+        }
+    }
+
+    FluidConfig fconfig = {nFluid, DAM_BREAK, vec3(0, 20, 0)};
+    Sim::Simulation* sim;
+    Sim::Rods::Groom groom;
+    if (groomPath) {
+        if (!groom.load(groomPath)) return -1;
+        sim = new Sim::Simulation(groom, fconfig, backend);
+    } else {
+        sim = new Sim::Simulation(loadHairConfigs(MESH_LARGE_HEAD), fconfig, backend);
+    }
+    sim->hair->headTrans = translate(mat4(1), headStartPos);
+    sim->reorder->interval = sortInterval;
+    sim->grid->stencil = stencil;
+    sim->hairSolver = hairSolver;
+    sim->chebyshev.enabled = chebyshev;
+    sim->hair->useTethers = tethers;
+    // timer queries need a GL context, and are left out of untimed runs so they do not perturb the measured throughput
+    gpuTimers.enabled = backend == GPU_BACKEND && timingsPath;
+    if (gpuTimers.enabled) gpuTimers.startCSV(timingsPath);
+
+    printf("Running %d ticks on the %s backend\n", ticks, backend == CPU_BACKEND ? "CPU" : "GPU");
+    int64_t startTime = Clock::now();
+    for (int t = 0; t < ticks; ++t) {
+        sim->simulate();
+        if (gpuTimers.enabled) gpuTimers.endFrame(simulationTick);
+    }
+    if (backend == GPU_BACKEND) glFinish();  // wait for all dispatches before stopping the clock
+    if (gpuTimers.enabled) gpuTimers.flush();
+    float seconds = Clock::toSeconds(Clock::now() - startTime);
+    seconds = std::max(seconds, 1e-3f);
+
+    double particleSteps = (double)totalParticleCount * simulationSubsteps * ticks;
+    printf("%d ticks in %.3f s\n", ticks, seconds);
+    printf("%.2f ticks/s\n", ticks / seconds);
+    printf("%.4e particles*substeps/s\n", particleSteps / seconds);
+    simTickTimes.print("Simulation tick");
+    if (backend == CPU_BACKEND && sim->cpu->listBuilds > 0) {
+        double listParticles = (double)(fluidParticleCount + porousParticleCount) * sim->cpu->listBuilds;
+        printf("%.2f grid candidates per particle per neighbour list build (%d builds)\n",
+               sim->cpu->candidatesVisited / listParticles, sim->cpu->listBuilds);
+    }
+    for (auto& section : gpuTimers.sections) {
+        printf("%-20s %8.4f ms/tick (GPU)\n", section.name.c_str(), section.average);
+    }
+    gpuTimers.stopCSV();
+    if (tracePath) Trace::dump(tracePath);
+
+    if (window) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+    return 0;
+}
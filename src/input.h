@@ -1,6 +1,5 @@
 #ifndef INPUT_H
 #define INPUT_H
-#include <windows.h>
 #include <iostream>
 #include <unordered_map>
 
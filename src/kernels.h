@@ -3,7 +3,7 @@
 
 #include "util.h"
 
-float poly6Kernel(vec3 r, float h) {
+inline float poly6Kernel(vec3 r, float h) {
     float sdst = dot(r, r);
     if (sdst >= h * h) return 0;
 
@@ -13,7 +13,7 @@ float poly6Kernel(vec3 r, float h) {
     return poly6Const * dff * dff * dff;
 }
 
-vec3 poly6KernelGrad(vec3 r, float h) {
+inline vec3 poly6KernelGrad(vec3 r, float h) {
     float sdst = dot(r, r);
     if (sdst >= h * h) return vec3(0);
 
@@ -23,7 +23,7 @@ vec3 poly6KernelGrad(vec3 r, float h) {
     return dff * dff * poly6GradConst * r;
 }
 
-float spikyKernel(vec3 r, float h) {
+inline float spikyKernel(vec3 r, float h) {
     float sdst = dot(r, r);
     if (sdst >= h * h) return 0;
 
@@ -33,7 +33,7 @@ float spikyKernel(vec3 r, float h) {
     return dff * dff * dff * spikyConst;
 }
 
-vec3 spikyKernelGrad(vec3 r, float h) {
+inline vec3 spikyKernelGrad(vec3 r, float h) {
     float sdst = dot(r, r);
     if (sdst >= h * h) return vec3(0);
 
@@ -44,7 +44,7 @@ vec3 spikyKernelGrad(vec3 r, float h) {
 }
 
 /* [AAI12, Eq. 2] */
-vec3 AI12STKernel(vec3 r, float h) {
+inline vec3 AI12STKernel(vec3 r, float h) {
     float sdst = dot(r, r);
     float dst = MAX(sqrt(sdst), 1e-9f);
     float splineGradConst = 32 / (PI * pow(h, 9));
@@ -60,7 +60,7 @@ vec3 AI12STKernel(vec3 r, float h) {
 }
 
 /* [AAI12, Eq. 6-7] */
-float AIT13SplineKernel(vec3 r, float h) {
+inline float AIT13SplineKernel(vec3 r, float h) {
     float sdst = dot(r, r);
     float dst = MAX(sqrt(sdst), 1e-9f);
     if (!(2 * dst > h && dst <= h)) return 0;
@@ -71,4 +71,44 @@ float AIT13SplineKernel(vec3 r, float h) {
     return splineGradConst * root;
 }
 
+inline float viscosityKernel(vec3 r_, float h) {
+    float sdst = dot(r_, r_);
+    if (sdst >= h * h) return 0;
+
+    float r = MAX(sqrt(sdst), 1e-9f);
+    float r2 = r * r;
+    float r3 = r2 * r;
+    float dff = (-r3 / (2 * pow(h, 3))) + (r2 / pow(h, 2)) + (h / (2 * r)) - 1;
+    float viscConst = 15.f / (2 * PI * pow(h, 3));
+    return dff * viscConst;
+}
+
+/* [AAI12, Eq. 2]. Matches `AAI12TKernelNorm` in kernels.comp */
+inline vec3 AAI12TKernelNorm(vec3 r, float h) {
+    float sdst = dot(r, r);
+    float dst = MAX(sqrt(sdst), 1e-9f);
+    float splineGradConst = 32 / (PI * pow(h, 9));
+    float dff = h - dst;
+    float prod = pow(dff, 3) * pow(dst, 3);
+    if (2 * dst > h && dst <= h) {
+        return splineGradConst * prod * (r / dst);
+    } else if (dst > 0 && 2 * dst <= h) {
+        return splineGradConst * (2 * prod - (pow(h, 6.f) / 64)) * (r / dst);
+    } else {
+        return vec3(0);
+    }
+}
+
+/* [AAI12, Eq. 6-7]. Matches `AAI12AdhesionKernelNorm` in kernels.comp */
+inline vec3 AAI12AdhesionKernelNorm(vec3 r, float h) {
+    float sdst = dot(r, r);
+    float dst = MAX(sqrt(sdst), 1e-9f);
+    if (!(2 * dst > h && dst <= h)) return vec3(0);
+
+    float rootVal = (-(4 * sdst) / h) + 6 * dst - 2 * h;
+    float root = pow(rootVal, 1.f / 4.f);  // quartic root
+    float splineGradConst = 0.007 / pow(h, 3.25);
+    return splineGradConst * root * (r / dst);
+}
+
 #endif /* KERNELS_H */
@@ -2,37 +2,121 @@
 #include <GLFW/glfw3.h>
 #include "main.h"
 
+// Let the driver compile shaders on its own threads, if it supports GL_KHR_parallel_shader_compile (or the ARB version)
+void enableParallelShaderCompile() {
+    typedef void (*MaxShaderCompilerThreadsProc)(GLuint count);
+    const char* exts[][2] = {{"GL_KHR_parallel_shader_compile", "glMaxShaderCompilerThreadsKHR"},
+                             {"GL_ARB_parallel_shader_compile", "glMaxShaderCompilerThreadsARB"}};
+    for (auto& [ext, fn] : exts) {
+        if (!glfwExtensionSupported(ext)) continue;
+        auto maxThreads = (MaxShaderCompilerThreadsProc)glfwGetProcAddress(fn);
+        if (!maxThreads) continue;
+        maxThreads(0xFFFFFFFF);  // as many as the implementation likes
+        Shader::deferLinking = true;
+        return;
+    }
+}
+
+// Import `mesh` on a worker thread. Its GL resources are created later by `StaticMesh::upload`
+std::future<void> importAsync(StaticMesh* mesh, const char* file) {
+    return std::async(std::launch::async, [mesh, file] {
+        TRACE_ZONE("StaticMesh::importMesh", file);
+        mesh->importMesh(file);
+    });
+}
+
 void init() {
+    TRACE_ZONE("init");
+    int64_t startupStart = Clock::now();
     glEnable(GL_DEBUG_OUTPUT);
     glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
     glDebugMessageCallback(MessageCallback, 0);
     glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, true);
     srand(time(nullptr));
 
+    /*
+     * Startup runs as a small dependency graph. CPU-only work runs on worker threads while the context thread creates GL objects:
+     *   workers: import render head | import guide head | import large head -> generate hair configs -> build simulation
+     *   context: scene, shaders, lighting -> (simulation built) simulation GL resources -> (heads imported) upload heads
+     *            -> finish shader links
+     */
+    renderHead = new StaticMesh();
+    renderHead->name = "Render Head";
+    guideHead = new StaticMesh();
+    guideHead->name = "Guide Head";
+    largeHead = new StaticMesh();
+    largeHead->name = "Root Head";
+
+    int64_t importTime = 0, buildTime = 0;
+    std::future<void> renderHeadImport = importAsync(renderHead, MESH_HEAD);
+    std::future<void> guideHeadImport = importAsync(guideHead, MESH_GUIDE_HEAD);
+    std::future<void> simulationBuild = std::async(std::launch::async, [&] {
+        int64_t t = Clock::now();
+        {
+            TRACE_ZONE("StaticMesh::importMesh", MESH_LARGE_HEAD);
+            largeHead->importMesh(MESH_LARGE_HEAD);
+        }
+        importTime = Clock::now() - t;
+
+        t = Clock::now();
+        TRACE_ZONE("Simulation::Simulation");
+        FluidConfig fconfig = {20000, DAM_BREAK, vec3(0, 20, 0)};
+        Sim::Rods::Groom groom;
+        if (groomPath && groom.load(groomPath)) {
+            sim = new Sim::Simulation(groom, fconfig, simulationBackend, false);
+            sim->hair->generateRenderStrands(renderStrandsPerGuide);
+            buildTime = Clock::now() - t;
+            return;
+        }
+        HairConfigs hs;
+        /* Generate hairs */
+        int rndCnt = 0;
+        for (int i = 0; i < largeHead->vertexData.size(); ++i) {
+            // if (rndCnt >= 512) break;
+            if (largeHead->vertexData[i].pos.y >= 0) {
+                // only normals facing out/up
+                hs.push_back({15, vec4(largeHead->vertexData[i].pos, 1), largeHead->vertexData[i].norm});
+                rndCnt++;
+            }
+        }
+        sim = new Sim::Simulation(hs, fconfig, simulationBackend, false);
+        sim->hair->generateRenderStrands(renderStrandsPerGuide);
+        buildTime = Clock::now() - t;
+    });
+
+    int64_t t = Clock::now();
+    enableParallelShaderCompile();
     SM::initScene();
     Input::initialiseInputMap();
 
     startShader = new Shader("starter", vert_smesh, frag_smesh);
     startLight = new Lighting("start light", startShader, MATERIAL_SHINY);
-    renderHead = new StaticMesh("Render Head", MESH_HEAD);
-    guideHead = new StaticMesh("Guide Head", MESH_GUIDE_HEAD);
-    largeHead = new StaticMesh("Root Head", MESH_LARGE_HEAD);
-
-    HairConfigs hs;
-    /* Generate hairs */
-    int rndCnt = 0;
-    for (int i = 0; i < largeHead->vertexData.size(); ++i) {
-        // if (rndCnt >= 512) break;
-        if (largeHead->vertexData[i].pos.y >= 0) {
-            // only normals facing out/up
-            hs.push_back({15, vec4(largeHead->vertexData[i].pos, 1), largeHead->vertexData[i].norm});
-            rndCnt++;
-        }
-    }
+    int64_t sceneTime = Clock::now() - t;
+
+    int64_t waitStart = Clock::now();
+    simulationBuild.get();
+    int64_t waitTime = Clock::now() - waitStart;
+
+    t = Clock::now();
+    sim->createGLResources();
+    renderHeadImport.get();
+    guideHeadImport.get();
+    renderHead->upload();
+    guideHead->upload();
+    largeHead->upload();
+    int64_t uploadTime = Clock::now() - t;
+
+    t = Clock::now();
+    Shader::finishPendingLinks();
+    Shader::deferLinking = false;
+    int64_t linkTime = Clock::now() - t;
+
+    printf("Startup: %.1f ms large head import, %.1f ms simulation build (workers) | %.1f ms scene and shaders, "
+           "%.1f ms waiting for workers, %.1f ms GL uploads, %.1f ms shader links (context thread) | %.1f ms total\n",
+           Clock::toMs(importTime), Clock::toMs(buildTime), Clock::toMs(sceneTime), Clock::toMs(waitTime),
+           Clock::toMs(uploadTime), Clock::toMs(linkTime), Clock::toMs(Clock::now() - startupStart));
 
     headStartPos = vec3(150, 6, 150);
-    FluidConfig fconfig = {20000, DAM_BREAK, vec3(0, 20, 0)};
-    sim = new Sim::Simulation(hs, fconfig);
     sim->hair->headTrans = translate(mat4(1), headStartPos);
 
     SM::camera->setPosition({120, 48.5, 52});
@@ -47,10 +131,11 @@ void init() {
     // startLight->addDirLightAtt(Util::RIGHT, vec3(0.2f), vec3(0.2f), vec3(1));
     // startLight->addDirLightAtt(Util::FORWARD, vec3(0.2f), vec3(0.2f), vec3(1));
     // startLight->addDirLightAtt(Util::BACKWARD, vec3(0.2f), vec3(0.2f), vec3(1));
-    SM::startTime = timeGetTime();
+    SM::startTime = Clock::now();
 }
 
 void update() {
+    TRACE_ZONE("update");
     SM::updateDelta();
     if (SM::cfg.isCamMode) {
         SM::camera->processMovement();
@@ -62,6 +147,7 @@ void update() {
 }
 
 void display() {
+    TRACE_ZONE("display");
     if (showFluid) {
         sim->fluid->envFBO->bind();
     }
@@ -88,6 +174,7 @@ void display() {
 }
 
 void displayUI() {
+    TRACE_ZONE("ImGui");
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
@@ -105,6 +192,32 @@ void displayUI() {
                 "Otherwise, the mouse simply acts as the cursor.");
             ImGui::TreePop();
         }
+        if (ImGui::TreeNodeEx("CPU Trace", ImGuiTreeNodeFlags_SpanAvailWidth)) {
+            bool tracing = Trace::enabled;
+            if (ImGui::Checkbox("Record Trace", &tracing)) Trace::enabled = tracing;
+            if (ImGui::Button("Save Trace")) Trace::dump("trace.json");
+            ImGui::SameLine();
+            if (ImGui::Button("Clear Trace")) Trace::clear();
+            UI::Help(
+                "Record how long each part of the frame takes on the CPU, and save it to trace.json. "
+                "Open the file in chrome://tracing or ui.perfetto.dev. Run with --trace to record from startup.");
+            ImGui::TreePop();
+        }
+        if (ImGui::TreeNodeEx("GPU Timings", ImGuiTreeNodeFlags_SpanAvailWidth)) {
+            ImGui::Checkbox("Enable Timers", &CommonSim::gpuTimers.enabled);
+            bool exporting = CommonSim::gpuTimers.streamingCSV();
+            if (ImGui::Checkbox("Export CSV", &exporting)) {
+                if (exporting) CommonSim::gpuTimers.startCSV("gpu_timings.csv");
+                else CommonSim::gpuTimers.stopCSV();
+            }
+            UI::Help(
+                "Write the GPU time of every simulation stage and fluid render pass to gpu_timings.csv, "
+                "one row per section per frame.");
+            for (auto& section : CommonSim::gpuTimers.sections) {
+                ImGui::Text("%-20s %7.3f ms (last %.3f)", section.name.c_str(), section.average, section.last);
+            }
+            ImGui::TreePop();
+        }
         if (ImGui::TreeNodeEx("Scene", ImGuiTreeNodeFlags_SpanAvailWidth)) {
             if (ImGui::TreeNodeEx("Background", ImGuiTreeNodeFlags_SpanAvailWidth)) {
                 ImGui::Checkbox("Show Skybox", &SM::cfg.showSkybox);
@@ -133,23 +246,62 @@ void displayUI() {
     if (ImGui::CollapsingHeader("Application\t\t\t", ImGuiTreeNodeFlags_DefaultOpen)) {
         if (ImGui::TreeNodeEx("Settings", ImGuiTreeNodeFlags_DefaultOpen | ImGuiTreeNodeFlags_SpanAvailWidth)) {
             if (ImGui::TreeNodeEx("Constraints", ImGuiTreeNodeFlags_SpanAvailWidth)) {
-                ImGui::DragFloat("SS Stiffness", &sim->hair->ss_k, .0001, 0.01, 1);
-                ImGui::DragFloat("SS SOR", &sim->hair->ss_SOR, .0001, 0.01, 10);
-                UI::Help(
-                    "[UPP14]\n"
-                    "Successive over-relaxation value for the POCR Stretch and Shear constraint.\n");
-                ImGui::NewLine();
-                ImGui::DragFloat("BT Stiffness", &sim->hair->bt_k, .0001, 0.01, 1);
-                ImGui::DragFloat("BT SOR", &sim->hair->bt_SOR, .0001, 0.01, 10);
+                ImGui::Checkbox("XPBD", &CommonSim::useXPBD);
                 UI::Help(
-                    "[UPP14]\n"
-                    "Successive over-relaxation value for the POCR Bend and Twist constraint.\n");
-                ImGui::DragFloat("DN SOR", &sim->fluid->SOR, 0.01f, 0.01, 10);
-                UI::Help(
-                    "[UPP14]\n"
-                    "Successive over-relaxation value for the PBF Density constraint.\n");
+                    "[MMC16]\n"
+                    "Solve the constraints with compliance instead of stiffness and SOR, so that how stiff they are does not change with the substeps or iterations.\n");
+                if (CommonSim::useXPBD) {
+                    ImGui::DragFloat("SS Compliance", &sim->hair->ss_alpha, 1e-9f, 0, 1, "%.2e");
+                    ImGui::DragFloat("BT Compliance", &sim->hair->bt_alpha, 1e-9f, 0, 1, "%.2e");
+                    ImGui::DragFloat("DN Compliance", &sim->fluid->alpha, 1e-9f, 0, 1, "%.2e");
+                } else {
+                    ImGui::DragFloat("SS Stiffness", &sim->hair->ss_k, .0001, 0.01, 1);
+                    ImGui::DragFloat("SS SOR", &sim->hair->ss_SOR, .0001, 0.01, 10);
+                    UI::Help(
+                        "[UPP14]\n"
+                        "Successive over-relaxation value for the POCR Stretch and Shear constraint.\n");
+                    ImGui::NewLine();
+                    ImGui::DragFloat("BT Stiffness", &sim->hair->bt_k, .0001, 0.01, 1);
+                    ImGui::DragFloat("BT SOR", &sim->hair->bt_SOR, .0001, 0.01, 10);
+                    UI::Help(
+                        "[UPP14]\n"
+                        "Successive over-relaxation value for the POCR Bend and Twist constraint.\n");
+                    ImGui::DragFloat("DN SOR", &sim->fluid->SOR, 0.01f, 0.01, 10);
+                    UI::Help(
+                        "[UPP14]\n"
+                        "Successive over-relaxation value for the PBF Density constraint.\n");
+                }
                 ImGui::DragInt("Substeps", &CommonSim::simulationSubsteps, .1, 1, 20);
                 ImGui::DragInt("Iterations", &CommonSim::simulationIterations, .1, 1, 20);
+                const char* solvers[] = {"Dispatch", "Strand", "Direct"};
+                ImGui::Combo("Hair Solver", (int*)&sim->hairSolver, solvers, IM_ARRAYSIZE(solvers));
+                UI::Help("Dispatch: two red-black dispatches per hair constraint per iteration.\n"
+                         "Strand: one dispatch per substep, each workgroup iterating on its strands in shared memory.\n"
+                         "Direct: one exact solve of each strand's constraints per substep. Ignores Iterations.");
+                ImGui::Checkbox("Tethers", &sim->hair->useTethers);
+                UI::Help(
+                    "[KCMF12]\n"
+                    "Long range attachments. Keep every hair vertex within its rest distance along the strand of the root, so that strands do not stretch when there are few iterations.\n"
+                    "Used by the dispatch and strand solvers.\n");
+                if (sim->hair->useTethers) ImGui::DragFloat("Tether Slack", &sim->hair->tetherSlack, .001, 1, 2);
+                ImGui::Checkbox("Chebyshev", &sim->chebyshev.enabled);
+                UI::Help(
+                    "[Wan15]\n"
+                    "Extrapolate each hair constraint iteration from the previous two, so that fewer iterations reach the same result.\n"
+                    "Used by the dispatch and strand solvers. Lower the spectral radii if the hair jitters.\n");
+                if (sim->chebyshev.enabled) {
+                    ImGui::DragFloat("SS Spectral Radius", &sim->chebyshev.ssRho, .001, 0, .999);
+                    ImGui::DragFloat("BT Spectral Radius", &sim->chebyshev.btRho, .001, 0, .999);
+                    ImGui::DragFloat("Under-relaxation", &sim->chebyshev.gamma, .001, .1, 1);
+                    ImGui::DragInt("Warm-up Iterations", &sim->chebyshev.warmup, .1, 0, 20);
+                }
+                ImGui::Checkbox("Incremental Grid", &sim->grid->incremental);
+                UI::Help("Move only the particles that changed grid cell, rebuilding the whole grid when more than the rebuild fraction have.");
+                ImGui::DragFloat("Grid Rebuild Fraction", &sim->grid->rebuildFraction, .001, 0, 1);
+                ImGui::Checkbox("Grid Every Substep", &sim->grid->everySubstep);
+                const char* stencils[] = {"27 cells at h", "8 cells at 2h"};
+                ImGui::Combo("Grid Stencil", (int*)&sim->grid->stencil, stencils, IM_ARRAYSIZE(stencils));
+                UI::Help("Cells searched for neighbours. The cell size follows the largest interaction radius to match.");
                 // if (ImGui::Button("Print Physics Settings")) {
                 //     sim->printPhysicsSettings();
                 // }
@@ -187,6 +339,7 @@ void displayUI() {
                 ImGui::TreePop();
             }
 
+            ImGui::Text("Backend: %s", sim->backend == CPU_BACKEND ? "CPU" : "GPU");
             ImGui::Checkbox("Play", &CommonSim::play);
             ImGui::Text("Tick: %d%s", CommonSim::simulationTick, 
                 (CommonSim::ticking &&  CommonSim::simulationTick >= CommonSim::nextTick) ? " (target reached)" : "");
@@ -211,6 +364,10 @@ void displayUI() {
                 ImGui::DragFloat("Metalness", &sim->hair->metalness, 0.01, 0, 1);
                 ImGui::DragFloat("Roughness", &sim->hair->roughness, 0.01, 0, 1);
                 ImGui::DragFloat("Fresnel Exponent", &sim->hair->fresnelExponent, 0.01, 0, 10);
+                if (!sim->hair->renderStrands.empty()) {
+                    ImGui::Checkbox("Show Render Strands", &sim->hair->showRenderStrands);
+                    ImGui::SliderFloat("Render Strand Clumping", &sim->hair->renderStrandClumping, 0, 1);
+                }
                 ImGui::TreePop();
             }
         }
@@ -224,6 +381,10 @@ void displayUI() {
                 ImGui::DragFloat("Adhesion", &sim->fluid->f_adhesion, 0.1, 0, 10000);
                 ImGui::DragFloat("Viscosity", &sim->fluid->f_viscosity, 0.001, 0, 3);
                 ImGui::DragFloat("Diffusion", &sim->fluid->fluidMassDiffusionFactor, 0.01, 0, 10);
+                ImGui::DragInt("Sort Interval", &sim->reorder->interval, .1, 0, 500);
+                UI::Help("Sort fluid particles into Z-order every N ticks so neighbours are close in memory. 0 disables sorting.");
+                ImGui::DragFloat("Neighbour Skin", &sim->fluid->neighbourSkin, .01, 0, 2);
+                UI::Help("Extra radius kept in the fluid neighbour lists so they can be reused across substeps. 0 rebuilds them every substep.");
                 ImGui::TreePop();
             }
 
@@ -270,7 +431,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     if (!io.WantCaptureKeyboard) {
         Input::updateKey(key, action);
         if (Input::isKeyPressed(Key::ESCAPE)) {
-            printf("%u", CommonSim::totalSimTime / CommonSim::simulationTick);
+            CommonSim::simTickTimes.print("Simulation tick");
             glfwSetWindowShouldClose(window, true);
         }
         if (Input::isKeyJustReleased(Key::LEFT_ALT) && Input::windowFocused) {
@@ -303,6 +464,16 @@ void window_focus_callback(GLFWwindow* window, int focused) {
 }
 
 int main(int argc, char const* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--cpu")) simulationBackend = CPU_BACKEND;
+        if (!strcmp(argv[i], "--trace")) Trace::enabled = true;  // record zones from startup, including shader compilation
+        if (!strcmp(argv[i], "--no-shader-cache")) Shader::useProgramCache = false;
+        if (!strcmp(argv[i], "--no-mesh-cache")) StaticMesh::useMeshCache = false;
+        if (!strcmp(argv[i], "--groom") && i + 1 < argc) groomPath = argv[++i];
+        if (!strcmp(argv[i], "--render-strands") && i + 1 < argc) renderStrandsPerGuide = atoi(argv[++i]);
+    }
+    Trace::setThreadName("main");
+
     // Set up OpenGL version (4.6)
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -360,6 +531,7 @@ int main(int argc, char const* argv[]) {
 
     // Main Loop
     while (!glfwWindowShouldClose(window)) {
+        TRACE_ZONE("frame");
         Input::updateOldKeys();
         Input::updateOldButtons();
         glfwPollEvents();
@@ -373,7 +545,11 @@ int main(int argc, char const* argv[]) {
         update();
         display();
         displayUI();
-        glfwSwapBuffers(window);
+        CommonSim::gpuTimers.endFrame(CommonSim::simulationTick);
+        {
+            TRACE_ZONE("glfwSwapBuffers");
+            glfwSwapBuffers(window);
+        }
     }
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -4,6 +4,8 @@
 #define GLM_ENABLE_EXPERIMENTAL
 
 #include <cstdio>
+#include <cstring>
+#include <future>
 #include <iostream>
 #include <sstream>
 
@@ -56,6 +58,9 @@ vec3 lightPos = vec3(0, 3, -5);
 vec3 lightCol = vec3(0.2, 1, 1);
 
 Sim::Simulation *sim;
+SimulationBackend simulationBackend = GPU_BACKEND;  // set with --cpu
+const char *groomPath = nullptr;                    // groom to load the hair from instead of generating it. set with --groom
+int renderStrandsPerGuide = 0;                      // render strands interpolated around each simulated strand. set with --render-strands
 StaticMesh *particle;
 vec3 headStartPos = vec3(0, 3, 0);
 vec3 headStartRot = vec3(0);
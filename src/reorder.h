@@ -0,0 +1,217 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include "sm.h"
+#include "util.h"
+#include "shader.h"
+#include "common_sim.h"
+#include "threadpool.h"
+#include "fluid.h"
+using namespace CommonSim;
+
+#define REORDER_DISPATCH_SIZE 256
+
+namespace Sim {
+
+// Sorts fluid particles by the Z-order (Morton) key of their grid cell, so particles that are close in space are close in memory.
+// Neighbour loops then read mostly from the same cache lines instead of jumping across the particle buffers.
+// Fluid particles move between slots when sorted; `slotToId` and `idToSlot` map between a particle's current slot and
+// the fluid index it was created with, so outside code can keep referring to a particle by its original index.
+class FluidReorder {
+   public:
+    FluidReorder(PBF::Fluid* f) : fluid(f) {}
+    ~FluidReorder() {}
+
+    // Size the permutation tables. All particles should be initialised by now
+    void init() {
+        int n = fluidParticleCount;
+        slotToId.resize(n);
+        idToSlot.resize(n);
+        for (int i = 0; i < n; ++i) slotToId[i] = idToSlot[i] = i;
+        nSortPairs = 1;
+        while (nSortPairs < n) nSortPairs <<= 1;
+    }
+
+    void createKernels() {
+        keysKernel = new Shader("reorder keys", {{DIR("Shaders/sim/sort/mortonKeys.comp"), GL_COMPUTE_SHADER}});
+        sortKernel = new Shader("reorder bitonic sort", {{DIR("Shaders/sim/sort/bitonicSort.comp"), GL_COMPUTE_SHADER}});
+        gatherKernel = new Shader("reorder gather", {{DIR("Shaders/sim/sort/gather.comp"), GL_COMPUTE_SHADER}});
+        applyKernel = new Shader("reorder apply", {{DIR("Shaders/sim/sort/apply.comp"), GL_COMPUTE_SHADER}});
+    }
+
+    void populateBuffers() {
+        auto bf = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT | GL_DYNAMIC_STORAGE_BIT;
+
+        glCreateBuffers(1, &sortPairsBuffer);
+        glNamedBufferStorage(sortPairsBuffer, sizeof(uvec2) * nSortPairs, nullptr, bf);
+
+        glCreateBuffers(1, &scratchBuffer);
+        glNamedBufferStorage(scratchBuffer, sizeof(FluidScratch) * std::max(fluidParticleCount, 1), nullptr, bf);
+
+        glCreateBuffers(1, &slotToIdBuffer);
+        glNamedBufferStorage(slotToIdBuffer, sizeof(int) * slotToId.size(), slotToId.data(), bf);
+
+        glCreateBuffers(1, &idToSlotBuffer);
+        glNamedBufferStorage(idToSlotBuffer, sizeof(int) * idToSlot.size(), idToSlot.data(), bf);
+    }
+
+    // Should the particles be sorted before simulating tick `tick`?
+    bool due(int tick) const {
+        return interval > 0 && fluidParticleCount > 1 && tick % interval == 0;
+    }
+
+    // Sort the fluid particles using compute shaders
+    void dispatchKernels(float cellSize) {
+        int nGroupsPairs = nSortPairs / REORDER_DISPATCH_SIZE + 1;
+        int nGroupsFluid = fluidParticleCount / REORDER_DISPATCH_SIZE + 1;
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, predictedPositionBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, fluid->densitiesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, fluid->lambdasBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, fluid->curvatureNormalsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, fluid->omegasBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, sortPairsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, scratchBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, slotToIdBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, idToSlotBuffer);
+
+        keysKernel->use();
+        keysKernel->setFloat("gridCellSize", cellSize);
+        keysKernel->setInt("fluidOffset", hairParticleCount);
+        keysKernel->setInt("fluidCount", fluidParticleCount);
+        keysKernel->setIVec3("minCell", minCell(cellSize));
+        glDispatchCompute(nGroupsPairs, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        sortKernel->use();
+        for (int k = 2; k <= nSortPairs; k <<= 1) {
+            for (int j = k >> 1; j > 0; j >>= 1) {
+                sortKernel->setInt("k", k);
+                sortKernel->setInt("j", j);
+                glDispatchCompute(nGroupsPairs, 1, 1);
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            }
+        }
+
+        gatherKernel->use();
+        gatherKernel->setInt("fluidOffset", hairParticleCount);
+        gatherKernel->setInt("fluidCount", fluidParticleCount);
+        glDispatchCompute(nGroupsFluid, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        applyKernel->use();
+        applyKernel->setInt("fluidOffset", hairParticleCount);
+        applyKernel->setInt("fluidCount", fluidParticleCount);
+        glDispatchCompute(nGroupsFluid, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        applyKernel->rmv();
+        tablesOnGPU = true;
+        fluid->neighboursStale = true;  // lists hold global indices, which have moved
+    }
+
+    // Sort the fluid particles on the CPU. Produces the same order as the kernels
+    void sortCPU(ThreadPool& pool, float cellSize) {
+        int n = fluidParticleCount;
+        ivec3 lo = minCell(cellSize);
+        order.resize(n);
+        pool.parallelFor(0, n, [&](int i) { order[i] = {mortonKey(ps[fToG(i)], cellSize, lo), i}; });
+        std::sort(order.begin(), order.end());
+
+        permute(pool, particles, hairParticleCount);
+        permute(pool, ps, hairParticleCount);
+        permute(pool, fluid->densities, 0);
+        permute(pool, fluid->lambdas, 0);
+        permute(pool, fluid->omegas, 0);
+        permute(pool, fluid->curvatureNormals, 0);
+        permute(pool, slotToId, 0);
+        pool.parallelFor(0, n, [&](int s) { idToSlot[slotToId[s]] = s; });
+        fluid->neighboursStale = true;  // lists hold global indices, which have moved
+    }
+
+    // Current slot of the fluid particle created with index `id`
+    int slotOf(int id) {
+        readTables();
+        return idToSlot[id];
+    }
+
+    // Index the fluid particle in slot `slot` was created with
+    int idAt(int slot) {
+        readTables();
+        return slotToId[slot];
+    }
+
+    // Z-order key of the grid cell containing `p`, relative to `lo`. Matches mortonKeys.comp
+    static unsigned mortonKey(vec4 p, float cellSize, ivec3 lo) {
+        ivec3 cell = ivec3(floor(vec3(p) / cellSize)) - lo;
+        uvec3 c = uvec3(clamp(cell, ivec3(0), ivec3(1023)));
+        return spreadBits(c.x) | (spreadBits(c.y) << 1) | (spreadBits(c.z) << 2);
+    }
+
+    int interval = 0;  // sort every `interval` ticks. 0 disables sorting
+    std::vector<int> slotToId;
+    std::vector<int> idToSlot;
+
+   private:
+    // Per-particle data copied by gather.comp. Matches `FluidScratch` in the sort kernels
+    struct FluidScratch {
+        Particle p;
+        vec4 ps;
+        vec4 omega;
+        vec4 curvatureNormal;
+        float density;
+        float lambda;
+        int id;
+        int pd;  // padding
+    };
+
+    static unsigned spreadBits(unsigned v) {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    // Cell at the lowest corner of the simulation bounds
+    static ivec3 minCell(float cellSize) {
+        return ivec3(floor((centre - bounds / 2.f) / cellSize));
+    }
+
+    static int fToG(int i_f) { return i_f + hairParticleCount; }
+
+    // Reorder the `fluidParticleCount` elements of `v` starting at `offset` into sorted order
+    template <typename T>
+    void permute(ThreadPool& pool, std::vector<T>& v, int offset) {
+        std::vector<T> tmp(v.begin() + offset, v.begin() + offset + fluidParticleCount);
+        pool.parallelFor(0, fluidParticleCount, [&](int s) { tmp[s] = v[offset + order[s].second]; });
+        std::copy(tmp.begin(), tmp.end(), v.begin() + offset);
+    }
+
+    // Bring the permutation tables back from the GPU if the kernels changed them
+    void readTables() {
+        if (!tablesOnGPU) return;
+        glGetNamedBufferSubData(slotToIdBuffer, 0, sizeof(int) * slotToId.size(), slotToId.data());
+        glGetNamedBufferSubData(idToSlotBuffer, 0, sizeof(int) * idToSlot.size(), idToSlot.data());
+        tablesOnGPU = false;
+    }
+
+    PBF::Fluid* fluid;
+    std::vector<std::pair<unsigned, int>> order;  // (key, slot) pairs (CPU only)
+    int nSortPairs = 1;                            // fluid particle count rounded up to a power of two
+    bool tablesOnGPU = false;                      // are the permutation tables on the CPU stale?
+
+    Shader* keysKernel;
+    Shader* sortKernel;
+    Shader* gatherKernel;
+    Shader* applyKernel;
+    unsigned sortPairsBuffer = 0;
+    unsigned scratchBuffer = 0;
+    unsigned slotToIdBuffer = 0;
+    unsigned idToSlotBuffer = 0;
+};
+}  // namespace Sim
+
+#endif /* REORDER_H */
@@ -1,5 +1,110 @@
 #define GLAD_GL_IMPLEMENTATION
 #include "shader.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#define PROGRAM_CACHE_DIR DIR(".shadercache/")
+#define PROGRAM_CACHE_MAGIC 0x43425053  // "SPBC"
+
+// Key a program by the text and type of every shader in it and by the GL implementation, which binaries are only valid for
+static uint64_t programKey(const std::vector<std::pair<std::string, GLenum>>& sources) {
+    uint64_t h = 14695981039346656037ull;  // FNV-1a
+    auto hashBytes = [&h](const void* data, size_t n) {
+        const unsigned char* p = (const unsigned char*)data;
+        for (size_t i = 0; i < n; ++i) h = (h ^ p[i]) * 1099511628211ull;
+    };
+    for (GLenum e : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+        const char* str = (const char*)glGetString(e);
+        if (str) hashBytes(str, strlen(str));
+    }
+    for (const auto& [text, type] : sources) {
+        hashBytes(&type, sizeof(type));
+        hashBytes(text.data(), text.size());
+    }
+    return h;
+}
+
+// Read a shader's source, replacing each `#include "file"` line with the text of `file`, found next to the shader. GLSL
+// has no includes of its own. The expanded text is what gets compiled and keyed in the program cache
+static std::string readShaderSource(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cout << "Failed to open file " << path << std::endl;
+        return "";
+    }
+
+    std::string text, line;
+    for (int lineNo = 1; getline(file, line); ++lineNo) {
+        if (line.starts_with("#include \"")) {
+            std::string name = line.substr(10, line.find('"', 10) - 10);
+            text += "#line 1\n" + readShaderSource((std::filesystem::path(path).parent_path() / name).string());
+            text += "#line " + std::to_string(lineNo + 1) + "\n";  // keep the includer's line numbers in compile errors
+        } else {
+            text += line + "\n";
+        }
+    }
+    return text;
+}
+
+static std::string programCachePath(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return PROGRAM_CACHE_DIR + name;
+}
+
+// Create a program from the binary cached under `key`. Returns 0 if there is none or the driver rejects it
+static GLuint loadProgramBinary(uint64_t key) {
+    std::ifstream in(programCachePath(key), std::ios::binary);
+    if (!in) return 0;
+    uint32_t magic = 0;
+    GLenum format = 0;
+    in.read((char*)&magic, sizeof(magic));
+    in.read((char*)&format, sizeof(format));
+    std::vector<char> binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (magic != PROGRAM_CACHE_MAGIC || binary.empty()) return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary.data(), binary.size());
+    GLint success = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        // e.g. after a driver update. Recompile from source and overwrite the binary
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Cache the binary of linked program `program` under `key`
+static void saveProgramBinary(GLuint program, uint64_t key) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+    std::error_code ec;
+    std::filesystem::create_directories(PROGRAM_CACHE_DIR, ec);
+    std::ofstream out(programCachePath(key), std::ios::binary | std::ios::trunc);
+    if (!out) return;
+    uint32_t magic = PROGRAM_CACHE_MAGIC;
+    out.write((const char*)&magic, sizeof(magic));
+    out.write((const char*)&format, sizeof(format));
+    out.write(binary.data(), binary.size());
+}
+
+// Whether programs may be loaded from and saved to the binary cache. Needs at least one binary format from the driver
+static bool programCacheUsable() {
+    if (!Shader::useProgramCache) return false;
+    static GLint formats = -1;
+    if (formats < 0) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
 
 void Shader::AddShader(GLuint ShaderProgram, const char* pShaderText,
                        GLenum ShaderType) {
@@ -15,7 +120,12 @@ void Shader::AddShader(GLuint ShaderProgram, const char* pShaderText,
     // Compile the shader and check for errors
     glCompileShader(ShaderObj);
     GLint success;
-    // Check for shader related errors using glGetShaderiv
+    // Check for shader related errors using glGetShaderiv. Deferred links report them once the program is needed instead,
+    // since asking now would wait for the driver to finish compiling
+    if (deferLinking) {
+        glAttachShader(ShaderProgram, ShaderObj);
+        return;
+    }
     glGetShaderiv(ShaderObj, GL_COMPILE_STATUS, &success);
     if (!success) {
         GLchar InfoLog[1024];
@@ -28,33 +138,24 @@ void Shader::AddShader(GLuint ShaderProgram, const char* pShaderText,
     glAttachShader(ShaderProgram, ShaderObj);
 }
 
-GLuint Shader::CompileShaders(const char* pVS, const char* pFS) {
-    // Start the process of setting up our shaders by creating a program ID
-    // Note: we will link all the shaders together into this ID
-    GLuint shaderProgramID = glCreateProgram();
-    if (shaderProgramID == 0) {
-        std::cerr << "Error creating shader program..." << std::endl;
-        std::cerr << "Press enter/return to exit..." << std::endl;
-        std::cin.get();
-        exit(1);
-    }
-
-    // Create two shader objects, one for the vertex, and one for the fragment shader
-    std::string pvs = Util::readFile(pVS);
-    std::string pfs = Util::readFile(pFS);
-    AddShader(shaderProgramID, pvs.c_str(), GL_VERTEX_SHADER);
-    AddShader(shaderProgramID, pfs.c_str(), GL_FRAGMENT_SHADER);
-
+// Check that `program` linked and validated, exiting if not. With deferred linking this is where compile errors are reported
+static void checkProgram(GLuint program) {
     GLint Success = 0;
     GLchar ErrorLog[1024] = {'\0'};
-    // After compiling all shader objects and attaching them to the program, we
-    // can finally link it
-    glLinkProgram(shaderProgramID);
     // check for program related errors using glGetProgramiv
-    glGetProgramiv(shaderProgramID, GL_LINK_STATUS, &Success);
+    glGetProgramiv(program, GL_LINK_STATUS, &Success);
     if (Success == GL_FALSE) {
-        glGetProgramInfoLog(shaderProgramID, sizeof(ErrorLog), NULL, ErrorLog);
-        glDeleteProgram(shaderProgramID);
+        GLuint attached[8];
+        GLsizei nAttached = 0;
+        glGetAttachedShaders(program, 8, &nAttached, attached);
+        for (int i = 0; i < nAttached; ++i) {
+            glGetShaderiv(attached[i], GL_COMPILE_STATUS, &Success);
+            if (Success) continue;
+            glGetShaderInfoLog(attached[i], sizeof(ErrorLog), NULL, ErrorLog);
+            std::cerr << "Error compiling shader: " << ErrorLog << std::endl;
+        }
+        glGetProgramInfoLog(program, sizeof(ErrorLog), NULL, ErrorLog);
+        glDeleteProgram(program);
         std::cerr << "Error linking shader program: " << ErrorLog << std::endl;
         std::cerr << "Press enter/return to exit..." << std::endl;
         std::cin.get();
@@ -63,16 +164,73 @@ GLuint Shader::CompileShaders(const char* pVS, const char* pFS) {
 
     // program has been successfully linked but needs to be validated to check
     // whether the program can execute given the current pipeline state
-    glValidateProgram(shaderProgramID);
+    glValidateProgram(program);
     // check for program related errors using glGetProgramiv
-    glGetProgramiv(shaderProgramID, GL_VALIDATE_STATUS, &Success);
+    glGetProgramiv(program, GL_VALIDATE_STATUS, &Success);
     if (!Success) {
-        glGetProgramInfoLog(shaderProgramID, sizeof(ErrorLog), NULL, ErrorLog);
+        glGetProgramInfoLog(program, sizeof(ErrorLog), NULL, ErrorLog);
         std::cerr << "Invalid shader program: " << ErrorLog << std::endl;
         std::cerr << "Press enter/return to exit..." << std::endl;
         std::cin.get();
         exit(1);
     }
+}
+
+void Shader::deferLink(bool cacheBinary, uint64_t key) {
+    linkPending = true;
+    pendingCacheBinary = cacheBinary;
+    pendingKey = key;
+    pendingLinks.push_back(this);
+}
+
+void Shader::ensureLinked() const {
+    if (!linkPending) return;
+    linkPending = false;
+    checkProgram(ID);
+    if (pendingCacheBinary) saveProgramBinary(ID, pendingKey);
+    cacheUniformLocations();
+}
+
+void Shader::finishPendingLinks() {
+    TRACE_ZONE("Shader::finishPendingLinks");
+    for (Shader* s : pendingLinks) s->ensureLinked();
+    pendingLinks.clear();
+}
+
+GLuint Shader::CompileShaders(const char* pVS, const char* pFS) {
+    TRACE_ZONE("Shader::CompileShaders", pFS);
+    std::string pvs = readShaderSource(pVS);
+    std::string pfs = readShaderSource(pFS);
+    bool cached = programCacheUsable();
+    uint64_t key = cached ? programKey({{pvs, GL_VERTEX_SHADER}, {pfs, GL_FRAGMENT_SHADER}}) : 0;
+    if (cached) {
+        if (GLuint program = loadProgramBinary(key)) return program;
+    }
+
+    // Start the process of setting up our shaders by creating a program ID
+    // Note: we will link all the shaders together into this ID
+    GLuint shaderProgramID = glCreateProgram();
+    if (shaderProgramID == 0) {
+        std::cerr << "Error creating shader program..." << std::endl;
+        std::cerr << "Press enter/return to exit..." << std::endl;
+        std::cin.get();
+        exit(1);
+    }
+
+    // Create two shader objects, one for the vertex, and one for the fragment shader
+    AddShader(shaderProgramID, pvs.c_str(), GL_VERTEX_SHADER);
+    AddShader(shaderProgramID, pfs.c_str(), GL_FRAGMENT_SHADER);
+
+    // After compiling all shader objects and attaching them to the program, we
+    // can finally link it
+    if (cached) glProgramParameteri(shaderProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(shaderProgramID);
+    if (deferLinking) {
+        deferLink(cached, key);
+        return shaderProgramID;
+    }
+    checkProgram(shaderProgramID);
+    if (cached) saveProgramBinary(shaderProgramID, key);
 
     // Note: this program will stay in effect for all draw calls until you
     // replace it with another or explicitly disable its use
@@ -80,6 +238,14 @@ GLuint Shader::CompileShaders(const char* pVS, const char* pFS) {
 }
 
 GLuint Shader::CompileTypedShader(const char* pS, GLenum type) {
+    TRACE_ZONE("Shader::CompileTypedShader", pS);
+    std::string ps = readShaderSource(pS);
+    bool cached = programCacheUsable();
+    uint64_t key = cached ? programKey({{ps, type}}) : 0;
+    if (cached) {
+        if (GLuint program = loadProgramBinary(key)) return program;
+    }
+
     // Start the process of setting up our shaders by creating a program ID
     // Note: we will link all the shaders together into this ID
     GLuint shaderProgramID = glCreateProgram();
@@ -91,36 +257,18 @@ GLuint Shader::CompileTypedShader(const char* pS, GLenum type) {
     }
 
     // Create the compute shader object
-    std::string ps = Util::readFile(pS);
     AddShader(shaderProgramID, ps.c_str(), type);
 
-    GLint Success = 0;
-    GLchar ErrorLog[1024] = {'\0'};
     // After compiling all shader objects and attaching them to the program, we
     // can finally link it
+    if (cached) glProgramParameteri(shaderProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(shaderProgramID);
-    // check for program related errors using glGetProgramiv
-    glGetProgramiv(shaderProgramID, GL_LINK_STATUS, &Success);
-    if (Success == 0) {
-        glGetProgramInfoLog(shaderProgramID, sizeof(ErrorLog), NULL, ErrorLog);
-        std::cerr << "Error linking shader program: " << ErrorLog << std::endl;
-        std::cerr << "Press enter/return to exit..." << std::endl;
-        std::cin.get();
-        exit(1);
-    }
-
-    // program has been successfully linked but needs to be validated to check
-    // whether the program can execute given the current pipeline state
-    glValidateProgram(shaderProgramID);
-    // check for program related errors using glGetProgramiv
-    glGetProgramiv(shaderProgramID, GL_VALIDATE_STATUS, &Success);
-    if (!Success) {
-        glGetProgramInfoLog(shaderProgramID, sizeof(ErrorLog), NULL, ErrorLog);
-        std::cerr << "Invalid shader program: " << ErrorLog << std::endl;
-        std::cerr << "Press enter/return to exit..." << std::endl;
-        std::cin.get();
-        exit(1);
+    if (deferLinking) {
+        deferLink(cached, key);
+        return shaderProgramID;
     }
+    checkProgram(shaderProgramID);
+    if (cached) saveProgramBinary(shaderProgramID, key);
 
     // Note: this program will stay in effect for all draw calls until you
     // replace it with another or explicitly disable its use
@@ -128,6 +276,15 @@ GLuint Shader::CompileTypedShader(const char* pS, GLenum type) {
 }
 
 GLuint Shader::CompileShaderGroup(std::vector<std::pair<std::string, GLenum>> pairs) {
+    TRACE_ZONE("Shader::CompileShaderGroup", pairs.empty() ? nullptr : pairs.back().first.c_str());
+    std::vector<std::pair<std::string, GLenum>> sources;
+    for (const auto& [path, shaderType] : pairs) sources.push_back({readShaderSource(path), shaderType});
+    bool cached = programCacheUsable();
+    uint64_t key = cached ? programKey(sources) : 0;
+    if (cached) {
+        if (GLuint program = loadProgramBinary(key)) return program;
+    }
+
     // Start the process of setting up our shaders by creating a program ID
     // Note: we will link all the shaders together into this ID
     GLuint shaderProgramID = glCreateProgram();
@@ -139,40 +296,45 @@ GLuint Shader::CompileShaderGroup(std::vector<std::pair<std::string, GLenum>> pa
     }
 
     // Create the shader objects
-    for (const auto& [path, shaderType] : pairs) {
-        std::string shaderText = Util::readFile(path.c_str());
+    for (const auto& [shaderText, shaderType] : sources) {
         AddShader(shaderProgramID, shaderText.c_str(), shaderType);
     }
 
-    GLint Success = 0;
-    GLchar ErrorLog[1024] = {'\0'};
     // After compiling all shader objects and attaching them to the program, we
     // can finally link it
+    if (cached) glProgramParameteri(shaderProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(shaderProgramID);
-    // check for program related errors using glGetProgramiv
-    glGetProgramiv(shaderProgramID, GL_LINK_STATUS, &Success);
-    if (Success == 0) {
-        glGetProgramInfoLog(shaderProgramID, sizeof(ErrorLog), NULL, ErrorLog);
-        std::cerr << "Error linking shader program: " << ErrorLog << std::endl;
-        std::cerr << "Press enter/return to exit..." << std::endl;
-        std::cin.get();
-        exit(1);
-    }
-
-    // program has been successfully linked but needs to be validated to check
-    // whether the program can execute given the current pipeline state
-    glValidateProgram(shaderProgramID);
-    // check for program related errors using glGetProgramiv
-    glGetProgramiv(shaderProgramID, GL_VALIDATE_STATUS, &Success);
-    if (!Success) {
-        glGetProgramInfoLog(shaderProgramID, sizeof(ErrorLog), NULL, ErrorLog);
-        std::cerr << "Invalid shader program: " << ErrorLog << std::endl;
-        std::cerr << "Press enter/return to exit..." << std::endl;
-        std::cin.get();
-        exit(1);
+    if (deferLinking) {
+        deferLink(cached, key);
+        return shaderProgramID;
     }
+    checkProgram(shaderProgramID);
+    if (cached) saveProgramBinary(shaderProgramID, key);
 
     // Note: this program will stay in effect for all draw calls until you
     // replace it with another or explicitly disable its use
     return shaderProgramID;
 }
+
+void Shader::cacheUniformLocations() const {
+    uniformLocations.clear();
+    if (ID == 0) return;
+    GLint count = 0, maxLength = 0;
+    glGetProgramInterfaceiv(ID, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+    glGetProgramInterfaceiv(ID, GL_UNIFORM, GL_MAX_NAME_LENGTH, &maxLength);
+    std::vector<GLchar> nameBuf(maxLength + 1);
+    const GLenum props[] = {GL_LOCATION};
+    for (GLint i = 0; i < count; ++i) {
+        GLint loc = -1;
+        glGetProgramResourceiv(ID, GL_UNIFORM, i, 1, props, 1, nullptr, &loc);
+        if (loc < 0) continue;  // uniform block members have no location
+        GLsizei length = 0;
+        glGetProgramResourceName(ID, GL_UNIFORM, i, nameBuf.size(), &length, nameBuf.data());
+        std::string uniformName(nameBuf.data(), length);
+        uniformLocations[uniformName] = loc;
+        // arrays are reported as "name[0]", but may also be set through "name"
+        if (uniformName.size() > 3 && uniformName.ends_with("[0]")) {
+            uniformLocations[uniformName.substr(0, uniformName.size() - 3)] = loc;
+        }
+    }
+}
@@ -5,33 +5,71 @@
 
 #include <GLM/vec2.hpp>
 #include <GLM/vec3.hpp>
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "util.h"
 
+// Typed handle to one uniform of a linked program. Setting it costs a single GL call and does not need the program in use
+template <typename T>
+struct UniformHandle {
+    GLuint program = 0;
+    GLint location = -1;  // -1 if the program has no such active uniform. Sets are then ignored by GL
+
+    void set(const T& v) const;
+    UniformHandle& operator=(const T& v) {
+        set(v);
+        return *this;
+    }
+};
+
+template <> inline void UniformHandle<bool>::set(const bool& v) const { glProgramUniform1i(program, location, (int)v); }
+template <> inline void UniformHandle<int>::set(const int& v) const { glProgramUniform1i(program, location, v); }
+template <> inline void UniformHandle<float>::set(const float& v) const { glProgramUniform1f(program, location, v); }
+template <> inline void UniformHandle<vec2>::set(const vec2& v) const { glProgramUniform2f(program, location, v.x, v.y); }
+template <> inline void UniformHandle<vec3>::set(const vec3& v) const { glProgramUniform3f(program, location, v.x, v.y, v.z); }
+template <> inline void UniformHandle<ivec3>::set(const ivec3& v) const { glProgramUniform3i(program, location, v.x, v.y, v.z); }
+template <> inline void UniformHandle<vec4>::set(const vec4& v) const { glProgramUniform4f(program, location, v.x, v.y, v.z, v.w); }
+template <> inline void UniformHandle<glm::mat3>::set(const glm::mat3& v) const {
+    glProgramUniformMatrix3fv(program, location, 1, GL_FALSE, &v[0][0]);
+}
+template <> inline void UniformHandle<glm::mat4>::set(const glm::mat4& v) const {
+    glProgramUniformMatrix4fv(program, location, 1, GL_FALSE, &v[0][0]);
+}
+
 class Shader {
    public:
     GLuint ID = 0;
     std::string name;
+    // Load linked programs from, and save them to, binaries in `.shadercache/`. Keyed by the shader sources and the driver
+    static inline bool useProgramCache = true;
+    // Return from compilation without waiting for the driver to link. Lets drivers with GL_KHR_parallel_shader_compile
+    // build several programs at once. A deferred program is checked when first used, or by `finishPendingLinks`
+    static inline bool deferLinking = false;
     Shader() {}
     // Create a vertex and fragment shader
     Shader(std::string shader_name, std::string vertex_shader_path, std::string fragment_shader_path) {
         name = shader_name;
         ID = CompileShaders(vertex_shader_path.c_str(), fragment_shader_path.c_str());
+        if (!linkPending) cacheUniformLocations();
     }
 
     // Create a typed shader
     Shader(std::string shader_name, std::string shader_path, GLenum shader_type) {
         name = shader_name;
         ID = CompileTypedShader(shader_path.c_str(), shader_type);
+        if (!linkPending) cacheUniformLocations();
     }
 
     // Create a set of attached shaders. Note that you may not combine compute and non-compute shaders
     Shader(std::string shader_name, std::vector<std::pair<std::string, GLenum>> shader_pairs) {
         name = shader_name;
         ID = CompileShaderGroup(shader_pairs);
+        if (!linkPending) cacheUniformLocations();
     }
 
     void AddShader(GLuint ShaderProgram, const char* pShaderText,
@@ -40,48 +78,92 @@ class Shader {
     GLuint CompileTypedShader(const char* pS, GLenum type);
     GLuint CompileShaderGroup(std::vector<std::pair<std::string, GLenum>> pairs);
 
+    // Fill the location cache with every active uniform of the linked program
+    void cacheUniformLocations() const;
+
+    // Check a deferred link, exiting on failure, then cache the program binary and uniform locations
+    void ensureLinked() const;
+
+    // Finish every deferred link
+    static void finishPendingLinks();
+
+    // Get the location of uniform `name`, or -1 if it is not active. Names missing from the cache are looked up once
+    GLint location(std::string_view name) const {
+        ensureLinked();
+        auto it = uniformLocations.find(name);
+        if (it != uniformLocations.end()) return it->second;
+        std::string key(name);
+        GLint loc = glGetUniformLocation(ID, key.c_str());
+        uniformLocations.emplace(std::move(key), loc);
+        return loc;
+    }
+
+    // Get a typed handle to uniform `name`
+    template <typename T>
+    UniformHandle<T> uniform(std::string_view name) const {
+        return {ID, location(name)};
+    }
+
     // activate the shader
-    void use() { glUseProgram(ID); }
+    void use() {
+        ensureLinked();
+        glUseProgram(ID);
+    }
     // deactivate the shader
     void rmv() { glUseProgram(0); }
 
     /* utility uniform functions */
     // set a boolean value
-    void setBool(const std::string& name, bool value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+    void setBool(std::string_view name, bool value) const {
+        glUniform1i(location(name), (int)value);
     }
-    void setInt(const std::string& name, int value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+    void setInt(std::string_view name, int value) const {
+        glUniform1i(location(name), value);
     }
     // set a float value
-    void setFloat(const std::string& name, float value) const {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+    void setFloat(std::string_view name, float value) const {
+        glUniform1f(location(name), value);
     }
     // set a vec2 value
-    void setVec2(const std::string& name, vec2 value) const {
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), value.x, value.y);
+    void setVec2(std::string_view name, vec2 value) const {
+        glUniform2f(location(name), value.x, value.y);
     }
     // set a vec3 value
-    void setVec3(const std::string& name, vec3 v) const {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), v.x, v.y, v.z);
+    void setVec3(std::string_view name, vec3 v) const {
+        glUniform3f(location(name), v.x, v.y, v.z);
     }
     // set an ivec3 value
-    void setIVec3(const std::string& name, ivec3 v) const {
-        glUniform3i(glGetUniformLocation(ID, name.c_str()), v.x, v.y, v.z);
+    void setIVec3(std::string_view name, ivec3 v) const {
+        glUniform3i(location(name), v.x, v.y, v.z);
     }
     // set a vec4 value
-    void setVec4(const std::string& name, vec4 v) const {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), v.x, v.y, v.z, v.w);
+    void setVec4(std::string_view name, vec4 v) const {
+        glUniform4f(location(name), v.x, v.y, v.z, v.w);
     }
     // set a mat3 value
-    void setMat3(const std::string& name, const glm::mat3& mat) const {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    void setMat3(std::string_view name, const glm::mat3& mat) const {
+        glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
     }
     // set a mat4 value
-    void setMat4(const std::string& name, const glm::mat4& mat) const {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE,
+    void setMat4(std::string_view name, const glm::mat4& mat) const {
+        glUniformMatrix4fv(location(name), 1, GL_FALSE,
                            &mat[0][0]);
     }
+
+   private:
+    void deferLink(bool cacheBinary, uint64_t key);
+
+    mutable bool linkPending = false;  // linked without checking the result. See `deferLinking`
+    bool pendingCacheBinary = false;   // save the program binary once the deferred link finishes
+    uint64_t pendingKey = 0;
+    static inline std::vector<Shader*> pendingLinks;
+
+    // Hashes `std::string_view` so that the cache can be searched without building a `std::string`
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+    };
+    mutable std::unordered_map<std::string, GLint, NameHash, std::equal_to<>> uniformLocations;
 };
 
 #endif /* SHADER_H */
@@ -1,12 +1,23 @@
 #include "simulation.h"
 
+#include <climits>
+#include <cstring>
+
 namespace Sim {
 
-Simulation::Simulation(HairConfigs hairConfigs, FluidConfig fluidConfig) {
+static const char* solverNames[] = {"dispatch", "strand", "direct"};
+
+Simulation::Simulation(HairConfigs hairConfigs, FluidConfig fluidConfig, SimulationBackend backend, bool createGL)
+    : Simulation(new Rods::Hair(hairConfigs), fluidConfig, backend, createGL) {}
+
+Simulation::Simulation(const Rods::Groom& groom, FluidConfig fluidConfig, SimulationBackend backend, bool createGL)
+    : Simulation(new Rods::Hair(groom), fluidConfig, backend, createGL) {}
+
+Simulation::Simulation(Rods::Hair* hairStrands, FluidConfig fluidConfig, SimulationBackend backend, bool createGL) : backend(backend) {
     grid = new SpatialGrid();
 
     hairParticleStartIdx = 0;
-    hair = new Rods::Hair(hairConfigs);
+    hair = hairStrands;
     hairParticleCount = particles.size();
     hairLoaded = true;
     fluidParticleStartIdx = hairParticleCount;
@@ -19,20 +30,51 @@ Simulation::Simulation(HairConfigs hairConfigs, FluidConfig fluidConfig) {
     poresLoaded = true;
     totalParticleCount = hairParticleCount + fluidParticleCount + porousParticleCount;
 
+    simulatedHeadTrans = hair->headTrans;
     preprocess();
-    populateBuffers();
+    if (createGL) createGLResources();
     printf("%d hair strands, %d hair particles, %d fluid particles, %d porous particles, %d total particles\n",
            hair->numStrands, hairParticleCount, fluidParticleCount, porousParticleCount, particles.size());
 }
 
 // Perform all pre-processing steps
 void Simulation::preprocess() {
+    grid->cellSize = grid->cellSizeFor(fluid->interactionRadius());
     grid->init();  // all particles should be initialised on object creation, but not buffered yet
-    fluid->createFramebuffers();
-    simulationShader = new Shader("simulation compute step",
-                                  {{DIR("Shaders/sim/compute/helper.comp"), GL_COMPUTE_SHADER},
-                                   {DIR("Shaders/sim/compute/kernels.comp"), GL_COMPUTE_SHADER},
-                                   {DIR("Shaders/sim/compute/simulation.comp"), GL_COMPUTE_SHADER}});
+    reorder = new FluidReorder(fluid);
+    reorder->init();
+    fluid->initNeighbourLists();
+    if (backend == CPU_BACKEND) cpu = new CPUSimulation(hair, fluid, grid);
+}
+
+// Create every shader, framebuffer and buffer
+void Simulation::createGLResources() {
+    if (!headless) {
+        hair->createShaders();
+        fluid->createShaders();
+        fluid->createFramebuffers();
+    }
+    if (backend == GPU_BACKEND) {
+        grid->createKernels();
+        reorder->createKernels();
+        simulationShader = new Shader("simulation compute step",
+                                      {{DIR("Shaders/sim/compute/helper.comp"), GL_COMPUTE_SHADER},
+                                       {DIR("Shaders/sim/compute/kernels.comp"), GL_COMPUTE_SHADER},
+                                       {DIR("Shaders/sim/compute/simulation.comp"), GL_COMPUTE_SHADER}});
+        strandSolverKernel = new Shader("hair strand solver",
+                                        {{DIR("Shaders/sim/compute/helper.comp"), GL_COMPUTE_SHADER},
+                                         {DIR("Shaders/sim/compute/strands.comp"), GL_COMPUTE_SHADER}});
+        directSolverKernel = new Shader("hair direct solver",
+                                        {{DIR("Shaders/sim/compute/helper.comp"), GL_COMPUTE_SHADER},
+                                         {DIR("Shaders/sim/compute/direct.comp"), GL_COMPUTE_SHADER}});
+        reorientKernel = new Shader("hair reorientation",
+                                    {{DIR("Shaders/sim/compute/helper.comp"), GL_COMPUTE_SHADER},
+                                     {DIR("Shaders/sim/compute/reorient.comp"), GL_COMPUTE_SHADER}});
+        chebyshevKernel = new Shader("hair chebyshev acceleration",
+                                     {{DIR("Shaders/sim/compute/helper.comp"), GL_COMPUTE_SHADER},
+                                      {DIR("Shaders/sim/compute/chebyshev.comp"), GL_COMPUTE_SHADER}});
+    }
+    if (backend == GPU_BACKEND || !headless) populateBuffers();
 }
 
 // Load all buffers, excluding Particles and predicted positions
@@ -40,16 +82,130 @@ void Simulation::populateBuffers() {
     grid->populateBuffers();   // load particles, predicted positions, and grid data
     hair->populateBuffers();   // load hair data (rods, darboux vectors, etc.) and porous particle data
     fluid->populateBuffers();  // load fluid data (densities, etc.)
+    reorder->populateBuffers();
+    resolveHairSolver();       // the strand groups and direct solver limits are known once the hair is loaded
 
     glCreateVertexArrays(1, &VAO);
+
+    glCreateBuffers(1, &paramsBuffer);
+    glNamedBufferStorage(paramsBuffer, sizeof(SimParams), &uploadedParams, GL_DYNAMIC_STORAGE_BIT);
+    std::fill(dispatchUniforms, dispatchUniforms + N_SIM_DISPATCH_UNIFORMS, INT_MIN);
 }
 
 void Simulation::simulate() {
-    /* Dispatch grid reconstruction outside substeps */
-    grid->dispatchKernels();
+    TRACE_ZONE("Simulation::simulate");
+    int64_t start = Clock::now();
+    float cellSize = grid->cellSizeFor(fluid->interactionRadius());
+    if (cellSize != grid->cellSize) grid->resize(cellSize);
+    if (hairSolver != resolvedSolver) resolveHairSolver();
+    followHeadRotation();
+    if (backend == CPU_BACKEND) simulateCPU();
+    else simulateGPU();  // only measures issuing the dispatches. See `gpuTimers` for GPU time
+    simTickTimes.add(Clock::now() - start);
+    simulationTick++;
+}
 
-    glBindVertexArray(VAO);
+void Simulation::followHeadRotation() {
+    mat4 head = hair->headTrans;
+    bool rotated = mat3(head) != mat3(simulatedHeadTrans);
+    mat4 last = simulatedHeadTrans;
+    simulatedHeadTrans = head;
+    if (!rotated) return;
 
+    // rotate about the head's last position. Translation is left to the roots in `predict`, so the hair still trails it
+    TRACE_ZONE("Simulation::followHeadRotation");
+    mat3 r = mat3(head) * inverse(mat3(last));
+    vec3 o = vec3(last[3]);
+    mat4 delta = translate(mat4(1), o) * mat4(r) * translate(mat4(1), -o);
+    if (backend == CPU_BACKEND) {
+        cpu->followHead(delta);
+        return;
+    }
+    bindBuffers();
+    quat q = quat_cast(r);
+    reorientKernel->use();
+    reorientKernel->setMat4("delta", delta);
+    reorientKernel->setVec4("rotation", vec4(q.x, q.y, q.z, q.w));
+    glDispatchCompute(ceil(hair->numStrands / (float)REORIENT_LOCAL_SIZE), 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    reorientKernel->rmv();
+}
+
+void Simulation::simulateCPU() {
+    if (reorder->due(simulationTick)) {
+        TRACE_ZONE("FluidReorder::sortCPU");
+        reorder->sortCPU(cpu->pool, grid->cellSize);
+        grid->invalidate();
+    }
+    {
+        TRACE_ZONE("SpatialGrid::buildCPU");
+        grid->buildCPU(cpu->pool);
+    }
+    {
+        TRACE_ZONE("CPUSimulation::simulate");
+        cpu->hairSolver = activeSolver;
+        cpu->chebyshev = chebyshev;
+        cpu->simulate();
+    }
+    if (!headless) glNamedBufferSubData(particleBuffer, 0, sizeof(Particle) * particles.size(), particles.data());
+}
+
+// Gather the parameters constant over a tick into `params`, and upload them if any have changed since the last upload
+void Simulation::updateParams(float sdt) {
+    fluid->restDensityInv = 1.f / fluid->restDensity;
+    params.headTrans = hair->headTrans;
+    for (int c = 0; c < 3; ++c) params.inertia[c] = vec4(hair->inertia[c], 0);
+    params.bounds = bounds;
+    params.dt = sdt;
+    params.centre = centre;
+    params.particleRadius = particleRadius;
+    params.fv_gravity = fv_gravity;
+    params.smoothingRadius = fluid->smoothingRadius;
+    params.fv_torque = hair->torque;
+    params.restDensity = fluid->restDensity;
+    params.up = Util::UP;
+    params.restDensityInv = fluid->restDensityInv;
+    grid->writeParams(params);
+    // XPBD leaves the positions where the constraints put them, so the over-relaxation factors are disabled
+    params.ss_SOR = useXPBD ? 1 : hair->ss_SOR;
+    params.ss_k = hair->ss_k;
+    params.bt_SOR = useXPBD ? 2 : hair->bt_SOR;
+    params.bt_k = hair->bt_k;
+    params.dn_SOR = useXPBD ? 1 : fluid->SOR;
+    params.dn_k = fluid->k;
+    params.relaxationEpsilon = fluid->relaxationEpsilon;
+    params.f_cohesion = fluid->f_cohesion;
+    params.f_curvature = fluid->f_curvature;
+    params.f_viscosity = fluid->f_viscosity;
+    params.f_adhesion = fluid->f_adhesion;
+    params.f_porosity = hair->f_porosity;
+    params.f_clumping = hair->f_clumping;
+    params.f_l_drag = hair->f_l_drag;
+    params.f_a_drag = hair->f_a_drag;
+    params.headRad = hair->renderHeadRadius;
+    params.fluidMassDiffusionFactor = fluid->fluidMassDiffusionFactor;
+    params.neighbourSkin = fluid->neighbourSkin;
+    params.neighbourRebuildDistance = fluid->neighbourRebuildDistance(sdt);
+    params.hairParticleCount = hairParticleCount;
+    params.fluidParticleCount = fluidParticleCount;
+    params.porousParticleCount = porousParticleCount;
+    params.poreSamples = hair->poreSamples;
+    params.clumpingRange = hair->clumpingRange;
+    params.xpbd = useXPBD;
+    params.ss_alpha = hair->ss_alpha;
+    params.bt_alpha = hair->bt_alpha;
+    params.dn_alpha = fluid->alpha;
+    params.tethers = hair->useTethers;
+    params.tetherSlack = hair->tetherSlack;
+    params.neighbourStride = fluid->neighbourStride;
+
+    if (memcmp(&params, &uploadedParams, sizeof(SimParams)) == 0) return;
+    glNamedBufferSubData(paramsBuffer, 0, sizeof(SimParams), &params);
+    uploadedParams = params;
+}
+
+// Bind every buffer read by simulation.comp
+void Simulation::bindBuffers() {
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleBuffer);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, predictedPositionBuffer);
 
@@ -67,58 +223,92 @@ void Simulation::simulate() {
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, hair->hairStrandBuffer);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, hair->restDarbouxBuffer);
 
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, fluid->neighboursBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, fluid->neighbourCountsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, fluid->neighbourKernelsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, fluid->listPositionsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, fluid->neighbourFlagsBuffer);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 25, hair->tetherLengthBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 21, hair->ssLambdaBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, hair->btLambdaBuffer);
+
+    glBindBufferBase(GL_UNIFORM_BUFFER, SIM_PARAMS_BINDING, paramsBuffer);
+}
+
+void Simulation::simulateGPU() {
+    /* Widen the neighbour lists if any overflowed. The flag is only read once the GPU has finished with it, so this never stalls */
+    if (listFence && glClientWaitSync(listFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) != GL_TIMEOUT_EXPIRED) {
+        glDeleteSync(listFence);
+        listFence = nullptr;
+        int overflowed = 0;
+        glGetNamedBufferSubData(fluid->neighbourFlagsBuffer, sizeof(int), sizeof(int), &overflowed);
+        if (overflowed) {
+            fluid->growNeighbourLists();
+            glClearNamedBufferData(fluid->neighbourFlagsBuffer, GL_R32I, GL_RED_INTEGER, GL_INT, nullptr);
+        }
+    }
+
+    /* Sort fluid particles into Z-order before the grid is rebuilt from their new slots */
+    if (reorder->due(simulationTick)) {
+        gpuTimers.begin("reorder");
+        reorder->dispatchKernels(grid->cellSize);
+        gpuTimers.end();
+        grid->invalidate();
+    }
+
+    /* Dispatch grid reconstruction outside substeps */
+    gpuTimers.begin("grid");
+    grid->dispatchKernels();
+    gpuTimers.end();
+
+    glBindVertexArray(VAO);
+
+    bindBuffers();
+
     simulationShader->use();
 
-    // todo: uniform buffer objects
     float sdt = dt / simulationSubsteps;
-    fluid->restDensityInv = 1.f / fluid->restDensity;
-    simulationShader->setFloat("dt", sdt);
-    simulationShader->setInt("hairParticleCount", hairParticleCount);
-    simulationShader->setInt("fluidParticleCount", fluidParticleCount);
-    simulationShader->setInt("porousParticleCount", porousParticleCount);
-    simulationShader->setVec3("bounds", bounds);
-    simulationShader->setVec3("centre", centre);
-    simulationShader->setFloat("ss_SOR", hair->ss_SOR);
-    simulationShader->setFloat("ss_k", hair->ss_k);
-    simulationShader->setFloat("bt_SOR", hair->bt_SOR);
-    simulationShader->setFloat("bt_k", hair->bt_k);
-    simulationShader->setFloat("dn_SOR", fluid->SOR);
-    simulationShader->setFloat("dn_k", fluid->k);
-    simulationShader->setFloat("particleRadius", particleRadius);
-    simulationShader->setFloat("smoothingRadius", fluid->smoothingRadius);
-    simulationShader->setFloat("restDensity", fluid->restDensity);
-    simulationShader->setFloat("restDensityInv", fluid->restDensityInv);
-    simulationShader->setFloat("relaxationEpsilon", fluid->relaxationEpsilon);
-    simulationShader->setFloat("f_cohesion", fluid->f_cohesion);
-    simulationShader->setFloat("f_curvature", fluid->f_curvature);
-    simulationShader->setFloat("f_viscosity", fluid->f_viscosity);
-    simulationShader->setFloat("f_adhesion", fluid->f_adhesion);
-    simulationShader->setFloat("f_porosity", hair->f_porosity);
-    simulationShader->setFloat("f_clumping", hair->f_clumping);
-    simulationShader->setFloat("f_l_drag", hair->f_l_drag);
-    simulationShader->setFloat("f_a_drag", hair->f_a_drag);
-    simulationShader->setVec3("fv_gravity", fv_gravity);
-    simulationShader->setVec3("fv_torque", hair->torque);
-    simulationShader->setMat3("inertia", hair->inertia);
-    simulationShader->setVec3("up", Util::UP);
-    simulationShader->setMat4("headTrans", hair->headTrans);
-    simulationShader->setFloat("headRad", hair->renderHeadRadius);
-    simulationShader->setInt("poreSamples", hair->poreSamples);
-    simulationShader->setFloat("gridCellSize", grid->cellSize);
-    simulationShader->setInt("simulationTick", simulationTick);
-    simulationShader->setInt("clumpingRange", hair->clumpingRange);
-    simulationShader->setFloat("fluidMassDiffusionFactor", fluid->fluidMassDiffusionFactor);
-
-    DWORD curr_time = timeGetTime();
+    updateParams(sdt);
+    setDispatchUniform(FORCE_NEIGHBOUR_REBUILD_UNIFORM, fluid->forceNeighbourRebuild(sdt));
+
     for (int i = 0; i < simulationSubsteps; ++i) {
+        if (i > 0 && grid->everySubstep) {
+            gpuTimers.begin("grid");
+            grid->dispatchKernels();
+            gpuTimers.end();
+            glBindVertexArray(VAO);
+            bindBuffers();
+            simulationShader->use();
+        }
+        if (useXPBD) {
+            glClearNamedBufferData(hair->ssLambdaBuffer, GL_RGBA32F, GL_RGBA, GL_FLOAT, nullptr);
+            glClearNamedBufferData(hair->btLambdaBuffer, GL_RGBA32F, GL_RGBA, GL_FLOAT, nullptr);
+        }
         for (int stage = 0; stage < N_SIM_STAGES; ++stage) {
-            simulationShader->setInt("stage", stage);
-            simulationShader->setInt("rbgs", -1);
+            setDispatchUniform(STAGE_UNIFORM, stage);
+            setDispatchUniform(RBGS_UNIFORM, -1);
+            gpuTimers.begin(stageNames[stage]);
             switch (stage) {
                 case APPLY_EXTERNAL_FORCES:
                     glDispatchCompute(ceil((hairParticleCount + fluidParticleCount) / DISPATCH_SIZE) + 1, 1, 1);
                     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
                     break;
+                case BUILD_NEIGHBOURS:
+                    glClearNamedBufferSubData(fluid->neighbourFlagsBuffer, GL_R32I, 0, sizeof(int), GL_RED_INTEGER, GL_INT, nullptr);  // stale flag only
+                    setDispatchUniform(NEIGHBOUR_PASS_UNIFORM, CHECK_NEIGHBOURS);
+                    glDispatchCompute(ceil((fluidParticleCount + porousParticleCount) / DISPATCH_SIZE) + 1, 1, 1);
+                    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+                    setDispatchUniform(NEIGHBOUR_PASS_UNIFORM, REFRESH_NEIGHBOURS);
+                    glDispatchCompute(ceil((fluidParticleCount + porousParticleCount) / DISPATCH_SIZE) + 1, 1, 1);
+                    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+                    if (fluid->neighboursStale) {
+                        fluid->markNeighboursBuilt();
+                        setDispatchUniform(FORCE_NEIGHBOUR_REBUILD_UNIFORM, fluid->forceNeighbourRebuild(sdt));
+                    }
+                    break;
                 case REP_VOLUME:
                     glDispatchCompute(ceil(porousParticleCount / DISPATCH_SIZE) + 1, 1, 1);
                     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
@@ -148,17 +338,37 @@ void Simulation::simulate() {
                     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
                     break;
                 case STRETCH_SHEAR_CONSTRAINT:
-                case BEND_TWIST_CONSTRAINT:
+                case BEND_TWIST_CONSTRAINT: {
+                    if (activeSolver != DISPATCH_SOLVER) {
+                        // both constraints are solved in the STRETCH_SHEAR_CONSTRAINT stage
+                        if (stage == BEND_TWIST_CONSTRAINT) break;
+                        if (activeSolver == STRAND_SOLVER) solveStrands();
+                        else solveDirect();
+                        break;
+                    }
+                    if (chebyshev.enabled) beginChebyshev();
+                    float omega = 1;
                     for (int iter = 0; iter < simulationIterations; ++iter) {
-                        simulationShader->setInt("rbgs", 0);
+                        setDispatchUniform(RBGS_UNIFORM, 0);
                         glDispatchCompute(ceil((hairParticleCount / 2) / DISPATCH_SIZE) + 1, 1, 1);
                         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-                        simulationShader->setInt("rbgs", 1);
+                        setDispatchUniform(RBGS_UNIFORM, 1);
                         glDispatchCompute(ceil((hairParticleCount / 2) / DISPATCH_SIZE) + 1, 1, 1);
                         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+                        if (chebyshev.enabled) accelerateHair(stage, iter, omega);
+
+                        // bound the stretch of whole strands at once rather than one segment per iteration
+                        if (stage == STRETCH_SHEAR_CONSTRAINT && hair->useTethers) {
+                            setDispatchUniform(STAGE_UNIFORM, LONG_RANGE_ATTACHMENT);
+                            glDispatchCompute(ceil(hairParticleCount / DISPATCH_SIZE) + 1, 1, 1);
+                            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+                            setDispatchUniform(STAGE_UNIFORM, stage);
+                        }
                     }
                     break;
+                }
                 case DENSITY_CONSTRAINT:
                     glDispatchCompute(ceil(fluidParticleCount / DISPATCH_SIZE) + 1, 1, 1);
                     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
@@ -178,17 +388,72 @@ void Simulation::simulate() {
                 default:
                     break;
             }
+            gpuTimers.end();
         }
     }
-    totalSimTime += timeGetTime() - curr_time;
-    // printf("%lu\n", totalSimTime);
 
     simulationShader->rmv();
     glBindVertexArray(0);
-    simulationTick++;
+    if (!listFence) listFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void Simulation::resolveHairSolver() {
+    resolvedSolver = hairSolver;
+    activeSolver = hairSolver;
+    // the CPU backend can solve any strand directly, and runs the strand solver as the dispatch solver
+    if (backend == GPU_BACKEND) {
+        if (hairSolver == STRAND_SOLVER && hair->strandGroups.empty()) activeSolver = DISPATCH_SOLVER;
+        if (hairSolver == DIRECT_SOLVER && !hair->directSolvable) activeSolver = DISPATCH_SOLVER;
+    }
+    if (activeSolver == hairSolver) printf("Using the %s hair solver\n", solverNames[activeSolver]);
+    else printf("The %s hair solver cannot solve this hair. Using the %s hair solver\n", solverNames[hairSolver], solverNames[activeSolver]);
+}
+
+void Simulation::solveStrands() {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, hair->strandGroupBuffer);
+    strandSolverKernel->use();
+    strandSolverKernel->setInt("iterations", simulationIterations);
+    strandSolverKernel->setInt("chebyshev", chebyshev.enabled);
+    strandSolverKernel->setFloat("ssRho", chebyshev.ssRho);
+    strandSolverKernel->setFloat("btRho", chebyshev.btRho);
+    strandSolverKernel->setFloat("gamma", chebyshev.gamma);
+    strandSolverKernel->setInt("warmup", chebyshev.warmup);
+    glDispatchCompute(hair->strandGroups.size(), 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    simulationShader->use();
+}
+
+void Simulation::beginChebyshev() {
+    GLsizeiptr psSize = sizeof(vec4) * hairParticleCount;
+    GLsizeiptr usSize = sizeof(quat) * hair->us.size();
+    for (int half = 0; half < 2; ++half) {
+        glCopyNamedBufferSubData(predictedPositionBuffer, hair->psIterateBuffer, 0, half * psSize, psSize);
+        glCopyNamedBufferSubData(hair->predictedRotationBuffer, hair->usIterateBuffer, 0, half * usSize, usSize);
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, hair->psIterateBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 24, hair->usIterateBuffer);
+}
+
+void Simulation::accelerateHair(int stage, int iter, float& omega) {
+    omega = chebyshev.omega(iter, stage == STRETCH_SHEAR_CONSTRAINT ? chebyshev.ssRho : chebyshev.btRho, omega);
+    chebyshevKernel->use();
+    chebyshevKernel->setFloat("omega", omega);
+    chebyshevKernel->setFloat("gamma", chebyshev.gamma);
+    chebyshevKernel->setInt("positions", stage == STRETCH_SHEAR_CONSTRAINT);
+    glDispatchCompute(ceil(std::max<float>(hairParticleCount, hair->us.size()) / DISPATCH_SIZE) + 1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    simulationShader->use();
+}
+
+void Simulation::solveDirect() {
+    directSolverKernel->use();
+    glDispatchCompute(ceil(hair->numStrands / (float)DIRECT_LOCAL_SIZE), 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    simulationShader->use();
 }
 
 void Simulation::update() {
+    TRACE_ZONE("Simulation::update");
     if (Input::isKeyJustPressed(Key::SPACE) && !SM::cfg.isCamMode) play = !play;
     if (play) {
         if ((ticking && simulationTick < nextTick) || !ticking) {
@@ -5,24 +5,76 @@
 #include "spatialgrid.h"
 #include "hair.h"
 #include "fluid.h"
+#include "cpu_sim.h"
+#include "reorder.h"
 #include "shader.h"
+#include "trace.h"
 
 using namespace CommonSim;
 namespace Sim {
 class Simulation {
    public:
-    Simulation(HairConfigs hairConfigs, FluidConfig fluidConfig);
+    // Build the hair, fluid and pores. Unless `createGL` is false, also create the GL resources,
+    // which must then be done later on the context thread with `createGLResources`
+    Simulation(HairConfigs hairConfigs, FluidConfig fluidConfig, SimulationBackend backend = GPU_BACKEND, bool createGL = true);
+
+    // As above, with the hair strands of a loaded groom
+    Simulation(const Rods::Groom& groom, FluidConfig fluidConfig, SimulationBackend backend = GPU_BACKEND, bool createGL = true);
+
+    // As above, with hair that has already been built. Its particles must be the only ones created so far
+    Simulation(Rods::Hair* hairStrands, FluidConfig fluidConfig, SimulationBackend backend = GPU_BACKEND, bool createGL = true);
     ~Simulation() {}
 
-    // Perform all pre-processing steps
+    // Perform all pre-processing steps. Does not touch GL
     void preprocess();
 
+    // Create the shaders, kernels, framebuffers and buffers. Must run on the GL context thread
+    void createGLResources();
+
     // Load all buffers, excluding Particles and predicted positions
     void populateBuffers();
 
     void update();
     void simulate();
 
+    // Dispatch all simulation stages as compute shaders
+    void simulateGPU();
+
+    // Run all simulation stages on the CPU, then upload the particles for rendering
+    void simulateCPU();
+
+    // Choose `activeSolver` for the requested `hairSolver`, falling back to the dispatch solver if the hair does not fit
+    // the one requested, and report the choice
+    void resolveHairSolver();
+
+    // Solve the hair constraints of one substep with the strand solver. The strands must fit in its groups
+    void solveStrands();
+
+    // Solve the hair constraints of one substep with the direct solver, one strand per thread. Every strand must fit it
+    void solveDirect();
+
+    // Rotate the pinned roots of the hair with the head if `headTrans` has rotated since the last tick. See reorient.comp
+    void followHeadRotation();
+
+    // Start Chebyshev acceleration of a constraint stage's iterations from the current predicted positions and orientations
+    void beginChebyshev();
+
+    // Extrapolate the hair iterates after iteration `iter` of `stage`. `omega` holds the weight of the previous iteration
+    void accelerateHair(int stage, int iter, float& omega);
+
+    // Bind every buffer read by simulation.comp
+    void bindBuffers();
+
+    // Gather the parameters constant over a tick into `params`, and upload them if any have changed since the last upload
+    void updateParams(float sdt);
+
+    // Set a uniform that changes between dispatches, skipping the call if it already holds `value`
+    void setDispatchUniform(SimDispatchUniform uniform, int value) {
+        if (dispatchUniforms[uniform] == value) return;
+        dispatchUniforms[uniform] = value;
+        glUniform1i(uniform, value);
+    }
+
     void tickTo(int t) {
         nextTick = t;
         ticking = true;
@@ -57,7 +109,24 @@ class Simulation {
     Rods::Hair* hair;
     PBF::Fluid* fluid;
     SpatialGrid* grid;
-    Shader* simulationShader;
+    FluidReorder* reorder;
+    CPUSimulation* cpu = nullptr;
+    Shader* simulationShader = nullptr;
+    Shader* strandSolverKernel = nullptr;  // strands.comp
+    Shader* directSolverKernel = nullptr;  // direct.comp
+    Shader* chebyshevKernel = nullptr;     // chebyshev.comp
+    Shader* reorientKernel = nullptr;      // reorient.comp
+    mat4 simulatedHeadTrans{1};            // head transform the hair was last simulated with
+    ChebyshevConfig chebyshev;
+    HairSolver hairSolver = STRAND_SOLVER;        // solver requested by the user
+    HairSolver activeSolver = DISPATCH_SOLVER;    // solver actually run. See `resolveHairSolver`
+    HairSolver resolvedSolver = DISPATCH_SOLVER;  // value of `hairSolver` that `activeSolver` was resolved for
+    SimParams params{};
+    SimParams uploadedParams{};  // contents of `paramsBuffer`
+    unsigned paramsBuffer = 0;
+    GLsync listFence = nullptr;  // signalled once a tick's neighbour overflow flag can be read without stalling
+    int dispatchUniforms[N_SIM_DISPATCH_UNIFORMS];  // last value set for each SimDispatchUniform. Uniforms keep their values between uses of the program
+    SimulationBackend backend;
     unsigned VAO;
 };
 }  // namespace Sim
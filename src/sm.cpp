@@ -12,8 +12,8 @@ enum CAMERA_MODE {
     FREE = 2
 };
 inline float delta = 0.0f;
-DWORD startTime = 0;
-DWORD tick = 0;
+int64_t startTime = 0;
+uint64_t tick = 0;
 
 float timer_c = 0;
 float timer_max = 0;
@@ -71,10 +71,10 @@ void drawSceneExtras() {
 }
 
 void updateDelta() {
-    static DWORD last_time = 0;
-    DWORD curr_time = timeGetTime();
-    if (last_time == 0) last_time = curr_time;
-    delta = (curr_time - last_time) * 0.001f;
+    static int64_t last_time = -1;
+    int64_t curr_time = Clock::now();
+    if (last_time < 0) last_time = curr_time;
+    delta = Clock::toSeconds(curr_time - last_time);
     last_time = curr_time;
 }
 
@@ -117,7 +117,7 @@ void toggleFreeCam() {
 }
 
 float getGlobalTime() {
-    return ((float)(timeGetTime() - SM::startTime)) * 0.001f;
+    return Clock::toSeconds(Clock::now() - SM::startTime);
 }
 
 void triggerTimer(int m) {
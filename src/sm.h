@@ -1,8 +1,8 @@
 #ifndef SM_H
 #define SM_H
 
-#include <windows.h>
 #include <iostream>
+#include "clock.h"
 #include "util.h"
 
 class Camera;
@@ -62,10 +62,10 @@ extern float comp_aspect;  // Ratio of the current window size to the original v
 extern float w_ratio;
 extern float h_ratio;
 
-// start time of the program
-extern DWORD startTime;
+// start time of the program, in `Clock::now()` nanoseconds
+extern int64_t startTime;
 // Times the `update()` function has been run. Essentially the current frame of the program
-extern DWORD tick;
+extern uint64_t tick;
 
 // scene camera
 extern Camera *camera;
@@ -5,36 +5,81 @@
 #include "util.h"
 #include "shader.h"
 #include "common_sim.h"
+#include "threadpool.h"
 using namespace CommonSim;
 
 #define GRID_DISPATCH_SIZE 8
+#define GRID_SCAN_BLOCK_SIZE 1024  // buckets scanned per workgroup by scan.comp. Must match BLOCK_SIZE in the scan kernels
+#define GRID_BUCKET_SLACK 2        // spare entries reserved per bucket for incremental updates. Must match BUCKET_SLACK in scan.comp
+#define GRID_BUCKETS_PER_PARTICLE 3  // buckets of a hashed grid per particle
+#define GRID_SORT_GROUPS 4096      // workgroups of sortBuckets.comp. Each sorts every GRID_SORT_GROUPS-th bucket
 
 // See [Grid]
-// Dense uniform grid
+// Uniform grid. Cells are hashed into `GRID_BUCKETS_PER_PARTICLE` buckets per particle. When the simulation bounds span no
+// more cells than that, every cell gets its own bucket instead and buckets are indexed linearly, so no two cells collide
+// and the table is no larger than a hashed one.
+// Each bucket's entries are sorted by particle index. Particles are stored hair first, then fluid, then porous, so every
+// bucket splits into one sub-range per phase and a stage can walk only the phases it reads.
+// Every bucket reserves `GRID_BUCKET_SLACK` spare entries. When few particles have changed bucket since the last update, only
+// those particles are moved and only the buckets they left or joined are re-sorted. The whole table is rebuilt when more than
+// `rebuildFraction` of the particles have moved, when a bucket runs out of spare entries, or after `invalidate`.
 class SpatialGrid {
    public:
     struct BucketData {
         int startIndex = 0;
         int particlesInBucket = 0;
         int nextParticleSlot = 0;
-        int pd;  // unsure why this needs to be included in the shaders too. usually padding doesn't need to be added
+        int fluidStart = 0;  // first entry holding a fluid particle
+        int poreStart = 0;   // first entry holding a porous particle
+        int capacity = 0;    // entries reserved for the bucket
+        int dirty = 0;       // set if the bucket has changed since it was last sorted
+        int pd;              // unsure why this needs to be included in the shaders too. usually padding doesn't need to be added
+    };
+
+    // Matches `GridState` in the grid kernels
+    struct GridState {
+        int fullRebuild;  // set if the whole table is rebuilt this update
+        int moved;        // particles that changed bucket since the last update
+        int maxMoved;     // moved particles above which the whole table is rebuilt
+        int pd;
     };
 
     SpatialGrid() {}
     ~SpatialGrid() {}
 
+    // Size the grid tables. All particles should be initialised by now
     void init() {
+        // one cell of margin on each side, so neighbour walks from the edge of the bounds stay inside the grid
+        minCell = ivec3(floor((centre - bounds / 2.f) / cellSize)) - 1;
+        dims = ivec3(floor((centre + bounds / 2.f) / cellSize)) + 2 - minCell;
+        long long nDenseCells = (long long)dims.x * dims.y * dims.z;
+        long long nHashedCells = (long long)ps.size() * GRID_BUCKETS_PER_PARTICLE;
+        dense = nDenseCells <= nHashedCells;
+        nTotalCells = dense ? nDenseCells + 1 : nHashedCells;  // dense grids keep one empty bucket for cells outside them
+        particleStartIndices.resize(nTotalCells);
+        cellEntries.resize(ps.size() + nTotalCells * GRID_BUCKET_SLACK, 0);
+        particleKeys.resize(ps.size());
+        invalidate();
+        nScanBlocks = (nTotalCells + GRID_SCAN_BLOCK_SIZE - 1) / GRID_SCAN_BLOCK_SIZE;
+    }
+
+    // Compile the grid kernels. Only needed when the grid is organised on the GPU
+    void createKernels() {
         resetGridKernel = new Shader("grid reset", {{DIR("Shaders/sim/grid/resetGrid.comp"), GL_COMPUTE_SHADER},
                                                     {DIR("Shaders/sim/grid/helper.comp"), GL_COMPUTE_SHADER}});
         countKernel = new Shader("grid count", {{DIR("Shaders/sim/grid/count.comp"), GL_COMPUTE_SHADER},
                                                 {DIR("Shaders/sim/grid/helper.comp"), GL_COMPUTE_SHADER}});
-        allocateKernel = new Shader("grid allocate", {{DIR("Shaders/sim/grid/allocate.comp"), GL_COMPUTE_SHADER},
-                                                      {DIR("Shaders/sim/grid/helper.comp"), GL_COMPUTE_SHADER}});
-        insertKernel = new Shader("grid insert", {{DIR("Shaders/sim/grid/insert.comp"), GL_COMPUTE_SHADER},
-                                                  {DIR("Shaders/sim/grid/helper.comp"), GL_COMPUTE_SHADER}});
-        nTotalCells = ps.size() * 3;
-        particleStartIndices.resize(nTotalCells);
-        cellEntries.resize(ps.size(), 0);
+        scanKernel = new Shader("grid scan", {{DIR("Shaders/sim/grid/scan.comp"), GL_COMPUTE_SHADER}});
+        scanBlockSumsKernel = new Shader("grid scan block sums", {{DIR("Shaders/sim/grid/scanBlockSums.comp"), GL_COMPUTE_SHADER}});
+        addBlockSumsKernel = new Shader("grid add block sums", {{DIR("Shaders/sim/grid/addBlockSums.comp"), GL_COMPUTE_SHADER}});
+        insertKernel = new Shader("grid insert", {{DIR("Shaders/sim/grid/insert.comp"), GL_COMPUTE_SHADER}});
+        sortBucketsKernel = new Shader("grid sort buckets", {{DIR("Shaders/sim/grid/sortBuckets.comp"), GL_COMPUTE_SHADER}});
+        detectMovedKernel = new Shader("grid detect moved", {{DIR("Shaders/sim/grid/detectMoved.comp"), GL_COMPUTE_SHADER},
+                                                             {DIR("Shaders/sim/grid/helper.comp"), GL_COMPUTE_SHADER}});
+        removeMovedKernel = new Shader("grid remove moved", {{DIR("Shaders/sim/grid/removeMoved.comp"), GL_COMPUTE_SHADER},
+                                                             {DIR("Shaders/sim/grid/helper.comp"), GL_COMPUTE_SHADER}});
+        insertMovedKernel = new Shader("grid insert moved", {{DIR("Shaders/sim/grid/insertMoved.comp"), GL_COMPUTE_SHADER},
+                                                             {DIR("Shaders/sim/grid/helper.comp"), GL_COMPUTE_SHADER}});
     }
 
     void populateBuffers() {
@@ -47,61 +92,312 @@ class SpatialGrid {
         glCreateBuffers(1, &predictedPositionBuffer);
         glNamedBufferStorage(predictedPositionBuffer, sizeof(vec4) * ps.size(), ps.data(), bf);
 
-        glCreateBuffers(1, &startIndicesBuffer);
-        glNamedBufferStorage(startIndicesBuffer, sizeof(BucketData) * particleStartIndices.size(), particleStartIndices.data(), bf);
+        populateTableBuffers();
 
-        glCreateBuffers(1, &cellEntriesBuffer);
-        glNamedBufferStorage(cellEntriesBuffer, sizeof(int) * cellEntries.size(), cellEntries.data(), bf);
+        glCreateBuffers(1, &stateBuffer);
+        glNamedBufferStorage(stateBuffer, sizeof(GridState), nullptr, bf);
+
+        glCreateBuffers(1, &keysBuffer);
+        glNamedBufferStorage(keysBuffer, sizeof(unsigned) * particleKeys.size(), particleKeys.data(), bf);
+
+        glCreateBuffers(1, &ranksBuffer);
+        glNamedBufferStorage(ranksBuffer, sizeof(int) * ps.size(), nullptr, bf);
+    }
+
+    // Cell size at which `stencil` finds every particle within `radius`
+    float cellSizeFor(float radius) const {
+        return stencil == STENCIL_8 ? 2 * radius : radius;
+    }
+
+    // Change the cell size, resizing the tables (and their buffers, if created) to match
+    void resize(float size) {
+        cellSize = size;
+        init();
+        if (!startIndicesBuffer) return;
+        glDeleteBuffers(1, &startIndicesBuffer);
+        glDeleteBuffers(1, &cellEntriesBuffer);
+        glDeleteBuffers(1, &blockSumsBuffer);
+        populateTableBuffers();
+    }
+
+    // Get the inclusive range of cells to search for the neighbours of `p`. Matches `stencilRange` in helper.comp.
+    // `rings` widens the stencil by that many extra cells on each side. 1 gives the 27 or 8 cell stencil
+    void stencilRange(vec4 p, int rings, ivec3& lo, ivec3& hi) const {
+        ivec3 cell = posToCell(p);
+        if (stencil == STENCIL_8) {
+            // step towards the neighbouring cell on the side of the half the point sits in
+            vec3 f = fract(vec3(p) / cellSize);
+            ivec3 offs = -ivec3(lessThan(f, vec3(0.5f)));
+            lo = cell + offs - (rings - 1);
+            hi = cell + offs + rings;
+        } else {
+            lo = cell - rings;
+            hi = cell + rings;
+        }
+    }
+
+    // Set the uniforms `posToCell` and `flatten` read in the grid helpers
+    void setUniforms(Shader* s) const {
+        s->setFloat("gridCellSize", cellSize);
+        s->setInt("gridDense", dense);
+        s->setIVec3("gridMinCell", minCell);
+        s->setIVec3("gridDims", dims);
+    }
 
-        glCreateBuffers(1, &totalParticleCountIndexBuffer);
-        glNamedBufferStorage(totalParticleCountIndexBuffer, sizeof(int) * totalParticleCountIndex.size(), totalParticleCountIndex.data(), bf);
+    // Write the grid parameters the simulation helpers read from the `SimParams` block
+    void writeParams(SimParams& p) const {
+        p.gridCellSize = cellSize;
+        p.gridDense = dense;
+        p.gridMinCell = minCell;
+        p.gridDims = dims;
+        p.gridStencil = stencil;
     }
 
-    // Organise the grid using compute shaders
+    // Rebuild the whole table on the next update. Needed whenever particles are moved between slots or the cell size changes
+    void invalidate() { fullRebuildDue = true; }
+
+    // Organise the grid using compute shaders.
+    // Both the incremental and the full kernels are always dispatched; whichever the GPU decides against returns immediately,
+    // so the choice never has to be read back
     void dispatchKernels() {
         glBindVertexArray(VAO);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, predictedPositionBuffer);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, startIndicesBuffer);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cellEntriesBuffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, totalParticleCountIndexBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, blockSumsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, stateBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, keysBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, ranksBuffer);
+
+        GridState state = {fullRebuildDue || !incremental, 0, maxMoved(), 0};
+        glNamedBufferSubData(stateBuffer, 0, sizeof(GridState), &state);
+        fullRebuildDue = false;
+
+        /* Incremental update: move only the particles that changed bucket */
+        if (incremental) {
+            detectMovedKernel->use();
+            setUniforms(detectMovedKernel);
+            glDispatchCompute(ceil(ps.size() / GRID_DISPATCH_SIZE) + 1, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
+            removeMovedKernel->use();
+            setUniforms(removeMovedKernel);
+            glDispatchCompute(ceil(particleStartIndices.size() / GRID_DISPATCH_SIZE) + 1, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            insertMovedKernel->use();
+            setUniforms(insertMovedKernel);
+            glDispatchCompute(ceil(ps.size() / GRID_DISPATCH_SIZE) + 1, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            sortBuckets(true);
+        }
+
+        /* Full rebuild */
         resetGridKernel->use();
-        resetGridKernel->setFloat("gridCellSize", cellSize);
+        setUniforms(resetGridKernel);
         glDispatchCompute(ceil(particleStartIndices.size() / GRID_DISPATCH_SIZE) + 1, 1, 1);
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
         countKernel->use();
-        countKernel->setFloat("gridCellSize", cellSize);
+        setUniforms(countKernel);
         glDispatchCompute(ceil(ps.size() / GRID_DISPATCH_SIZE) + 1, 1, 1);
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-        allocateKernel->use();
-        allocateKernel->setFloat("gridCellSize", cellSize);
-        glDispatchCompute(ceil(particleStartIndices.size() / GRID_DISPATCH_SIZE) + 1, 1, 1);
+        /* Exclusive scan of the bucket counts: scan each block, scan the block totals, then offset each block by its total */
+        scanKernel->use();
+        glDispatchCompute(nScanBlocks, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        scanBlockSumsKernel->use();
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        addBlockSumsKernel->use();
+        glDispatchCompute(nScanBlocks, 1, 1);
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
         insertKernel->use();
-        insertKernel->setFloat("gridCellSize", cellSize);
         glDispatchCompute(ceil(ps.size() / GRID_DISPATCH_SIZE) + 1, 1, 1);
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
+        sortBuckets(false);
+
         glBindVertexArray(0);
     }
 
+    // Organise the grid on the CPU. Does the same work as the grid kernels and produces the same table
+    void buildCPU(ThreadPool& pool) {
+        int n = ps.size();
+        newKeys.resize(n);
+        pool.parallelFor(0, n, [&](int i) { newKeys[i] = flatten(posToCell(ps[i])); });
+
+        if (!fullRebuildDue && incremental && updateCPU(pool)) return;
+        fullRebuildDue = false;
+
+        std::swap(particleKeys, newKeys);
+        for (auto& b : particleStartIndices) b = BucketData();
+        for (int i = 0; i < n; ++i) particleStartIndices[particleKeys[i]].particlesInBucket++;
+        int start = 0;
+        for (auto& b : particleStartIndices) {
+            b.startIndex = start;
+            b.capacity = b.particlesInBucket + GRID_BUCKET_SLACK;
+            start += b.capacity;
+        }
+        for (int i = 0; i < n; ++i) {
+            BucketData& b = particleStartIndices[particleKeys[i]];
+            cellEntries[b.startIndex + b.nextParticleSlot++] = i;
+        }
+
+        // entries were inserted in index order, so each bucket is already sorted
+        pool.parallelFor(0, particleStartIndices.size(), [&](int k) { splitPhases(particleStartIndices[k]); });
+    }
+
+    // Range [start, end) of the entries of bucket `b` holding particles of phase `phase`. Matches `bucketRange` in simulation.comp
+    static ivec2 phaseRange(const BucketData& b, Phase phase) {
+        int end = b.startIndex + b.particlesInBucket;
+        switch (phase) {
+            case HAIR: return ivec2(b.startIndex, b.fluidStart);
+            case FLUID: return ivec2(b.fluidStart, b.poreStart);
+            case PORE: return ivec2(b.poreStart, end);
+            default: return ivec2(end, end);
+        }
+    }
+
+    // Get the grid cell containing point `v`. Matches `posToCell` in helper.comp
+    ivec3 posToCell(vec4 v) const {
+        return ivec3(floor(v.x / cellSize), floor(v.y / cellSize), floor(v.z / cellSize));
+    }
+
+    // Convert a grid cell `cell` to a bucket index. Matches `flatten` in helper.comp, including its integer wrapping
+    unsigned flatten(ivec3 cell) const {
+        if (dense) {
+            ivec3 c = cell - minCell;
+            if (any(lessThan(c, ivec3(0))) || any(greaterThanEqual(c, dims))) return particleStartIndices.size() - 1;
+            return c.x + dims.x * (c.y + dims.y * c.z);
+        }
+        unsigned tmpx = (unsigned)cell.x * 78455519u;
+        unsigned tmpy = (unsigned)cell.y * 41397959u;
+        unsigned tmpz = (unsigned)cell.z * 27614441u;
+        unsigned h = tmpx ^ tmpy ^ tmpz;
+        if ((int)h < 0) h = 0u - h;  // abs() without overflowing on INT_MIN
+        return h % (unsigned)particleStartIndices.size();
+    }
+
     int nTotalCells = 0;
-    float cellSize = 1;
-    std::vector<int> totalParticleCountIndex = {0};
+    float cellSize = 1;    // set from the largest interaction radius with `cellSizeFor`
+    GridStencil stencil = STENCIL_27;
+    bool dense = false;    // index cells linearly from `minCell` instead of hashing them. Chosen from the bounds and particle count in `init`
+    ivec3 minCell{0};      // lowest cell of a dense grid
+    ivec3 dims{0};         // cells along each axis of a dense grid
+    bool incremental = true;      // move only the particles that changed bucket when few have
+    float rebuildFraction = 0.1;  // fraction of particles that may change bucket before the whole table is rebuilt
+    bool everySubstep = false;    // refresh the grid before every substep rather than once per tick
     std::vector<BucketData> particleStartIndices;
     Shader *resetGridKernel;
     Shader *countKernel;
-    Shader *allocateKernel;
+    Shader *scanKernel;
+    Shader *scanBlockSumsKernel;
+    Shader *addBlockSumsKernel;
     Shader *insertKernel;
+    Shader *sortBucketsKernel;
+    Shader *detectMovedKernel;
+    Shader *removeMovedKernel;
+    Shader *insertMovedKernel;
     unsigned VAO = 0;
     unsigned startIndicesBuffer = 0;
     unsigned cellEntriesBuffer = 0;
-    unsigned totalParticleCountIndexBuffer = 0;
+    unsigned blockSumsBuffer = 0;  // scanned total of each block of buckets
+    unsigned stateBuffer = 0;      // `GridState`
+    unsigned keysBuffer = 0;       // bucket each particle is filed in
+    unsigned ranksBuffer = 0;      // slot of each particle within its bucket, from the count pass
+    int nScanBlocks = 0;
     std::vector<int> startIndices;
     std::vector<int> cellEntries;
+    std::vector<unsigned> particleKeys;  // bucket each particle is filed in (CPU only)
+
+   private:
+    // Create the buffers whose size depends on the number of buckets
+    void populateTableBuffers() {
+        auto bf = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT | GL_DYNAMIC_STORAGE_BIT;
+
+        glCreateBuffers(1, &startIndicesBuffer);
+        glNamedBufferStorage(startIndicesBuffer, sizeof(BucketData) * particleStartIndices.size(), particleStartIndices.data(), bf);
+
+        glCreateBuffers(1, &cellEntriesBuffer);
+        glNamedBufferStorage(cellEntriesBuffer, sizeof(int) * cellEntries.size(), cellEntries.data(), bf);
+
+        glCreateBuffers(1, &blockSumsBuffer);
+        glNamedBufferStorage(blockSumsBuffer, sizeof(int) * nScanBlocks, nullptr, bf);
+    }
+
+    // Moved particles above which the whole table is rebuilt
+    int maxMoved() const { return rebuildFraction * ps.size(); }
+
+    void sortBuckets(bool incrementalPass) {
+        sortBucketsKernel->use();
+        sortBucketsKernel->setInt("fluidOffset", hairParticleCount);
+        sortBucketsKernel->setInt("poreOffset", hairParticleCount + fluidParticleCount);
+        sortBucketsKernel->setInt("incremental", incrementalPass);
+        glDispatchCompute(std::min<size_t>(particleStartIndices.size(), GRID_SORT_GROUPS), 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    // Move the particles whose bucket changed from `particleKeys` to `newKeys`. Same steps as the incremental kernels.
+    // Returns false, leaving the table for a full rebuild, if too many particles moved or a bucket ran out of spare entries
+    bool updateCPU(ThreadPool& pool) {
+        int n = ps.size();
+        moved.clear();
+        for (int i = 0; i < n; ++i) {
+            if (newKeys[i] != particleKeys[i]) moved.push_back(i);
+        }
+        if ((int)moved.size() > maxMoved()) return false;
+
+        for (int i : moved) {
+            particleStartIndices[particleKeys[i]].dirty = 1;
+            particleStartIndices[newKeys[i]].dirty = 1;
+        }
+        pool.parallelFor(0, particleStartIndices.size(), [&](int k) {
+            BucketData& b = particleStartIndices[k];
+            if (!b.dirty) return;
+            int end = b.startIndex + b.particlesInBucket;
+            int kept = b.startIndex;
+            for (int s = b.startIndex; s < end; ++s) {
+                if (newKeys[cellEntries[s]] == (unsigned)k) cellEntries[kept++] = cellEntries[s];
+            }
+            b.particlesInBucket = kept - b.startIndex;
+        });
+        for (int i : moved) {
+            BucketData& b = particleStartIndices[newKeys[i]];
+            if (b.particlesInBucket >= b.capacity) return false;
+            cellEntries[b.startIndex + b.particlesInBucket++] = i;
+            particleKeys[i] = newKeys[i];
+        }
+        pool.parallelFor(0, particleStartIndices.size(), [&](int k) {
+            BucketData& b = particleStartIndices[k];
+            if (!b.dirty) return;
+            std::sort(cellEntries.begin() + b.startIndex, cellEntries.begin() + b.startIndex + b.particlesInBucket);
+            splitPhases(b);
+            b.dirty = 0;
+        });
+        return true;
+    }
+
+    // Record where the fluid and porous entries of sorted bucket `b` begin
+    void splitPhases(BucketData& b) {
+        int fluidOffset = hairParticleCount;
+        int poreOffset = hairParticleCount + fluidParticleCount;
+        int end = b.startIndex + b.particlesInBucket;
+        b.fluidStart = b.poreStart = end;
+        for (int s = end - 1; s >= b.startIndex; --s) {
+            if (cellEntries[s] >= fluidOffset) b.fluidStart = s;
+            if (cellEntries[s] >= poreOffset) b.poreStart = s;
+        }
+    }
+
+    bool fullRebuildDue = true;      // rebuild the whole table on the next update
+    std::vector<unsigned> newKeys;   // bucket each particle is in now (CPU only)
+    std::vector<int> moved;          // particles that changed bucket this update (CPU only)
 };
 
 #endif /* SPATIALGRID_H */
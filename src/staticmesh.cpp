@@ -1,5 +1,51 @@
 #include "staticmesh.h"
 
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#define MESH_CACHE_MAGIC 0x4853454d  // "MESH"
+#define MESH_CACHE_VERSION 1         // bump when the layout below or the import changes
+
+// Size and modification time of a file the mesh is imported from. Zero if the file does not exist
+struct SourceStamp {
+    uint64_t size = 0;
+    int64_t time = 0;
+};
+
+// Start of a mesh cache file. Followed by the vertices, indices and submeshes, then the texture paths of each material
+// as a length-prefixed string per slot (empty if the slot has no texture)
+struct MeshCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t loadFlags;  // AI_LOAD_FLAGS the mesh was imported with
+    uint32_t nVertices;
+    uint32_t nIndices;
+    uint32_t nMeshes;
+    uint32_t nMaterials;
+    uint32_t pad;
+    SourceStamp sources[2];  // the model file and its binary buffer
+};
+static_assert(sizeof(MeshCacheHeader) == 64, "MeshCacheHeader must have no implicit padding");
+
+static SourceStamp stampFile(const std::string& path) {
+    SourceStamp stamp;
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec) return stamp;
+    auto time = std::filesystem::last_write_time(path, ec);
+    if (ec) return stamp;
+    stamp.size = size;
+    stamp.time = time.time_since_epoch().count();
+    return stamp;
+}
+
+// Stamp the model file at `rpath` and the buffer next to it with the same name (e.g. the .bin of a .gltf)
+static void stampSources(const std::string& rpath, SourceStamp (&sources)[2]) {
+    sources[0] = stampFile(rpath);
+    sources[1] = stampFile(rpath.substr(0, rpath.rfind('.')) + ".bin");
+}
+
 StaticMesh::~StaticMesh() {}
 
 /// <summary>
@@ -9,25 +55,139 @@ StaticMesh::~StaticMesh() {}
 /// <returns>A boolean. True if loading succeeds, false otherwise.</returns>
 bool StaticMesh::loadMesh(std::string mesh_file_name, bool popBuffers) {
     populateBuffer = popBuffers;
+    if (!importMesh(mesh_file_name)) return false;
+    return upload();
+}
 
+// Import the mesh and decode its textures without touching GL, so that it may run on any thread.
+// Reads the mesh cache instead of the model if it is up to date, and writes it otherwise
+bool StaticMesh::importMesh(std::string mesh_file_name) {
     std::string rpath = MODELPATH(mesh_file_name) + mesh_file_name;
+    std::string cpath = rpath.substr(0, rpath.rfind('.')) + MESH_CACHE_EXTENSION;
+    if (useMeshCache && loadMeshCache(cpath, mesh_file_name)) return true;
+
     scene = aiImportFile(
         rpath.c_str(),
         AI_LOAD_FLAGS);
 
-    bool valid_scene = false;
-
     if (!scene) {
         fprintf(stderr, "ERROR: reading mesh %s\n%s", rpath.c_str(), aiGetErrorString());
-        valid_scene = false;
-    } else {
-        valid_scene = initScene(scene, mesh_file_name);
+        return false;
+    }
+    if (!initScene(scene, mesh_file_name)) return false;
+    if (useMeshCache && cacheable) saveMeshCache(cpath, mesh_file_name);
+    return true;
+}
+
+// Load the vertices, indices, submeshes and textures of the mesh from the cache at `cache_file_name`.
+// The cache is mapped rather than read and stays mapped until `upload`, which creates the buffers straight from it.
+// Returns false if there is no cache or it is stale, i.e. written by another version or from a model file that has
+// since changed
+bool StaticMesh::loadMeshCache(std::string cache_file_name, std::string mesh_file_name) {
+    if (!meshCache.open(cache_file_name)) return false;
+    auto stale = [this] {
+        meshCache.close();
+        return false;
+    };
+    const unsigned char* data = meshCache.data();
+    size_t size = meshCache.size();
+
+    MeshCacheHeader header;
+    SourceStamp sources[2];
+    stampSources(MODELPATH(mesh_file_name) + mesh_file_name, sources);
+    if (size < sizeof(header)) return stale();
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION || header.loadFlags != (AI_LOAD_FLAGS) ||
+        memcmp(header.sources, sources, sizeof(sources)) != 0)
+        return stale();
+
+    size_t offset = sizeof(header);
+    size_t arrays = sizeof(Vertex) * header.nVertices + sizeof(unsigned int) * header.nIndices + sizeof(MeshObject) * header.nMeshes;
+    if (size - offset < arrays) return stale();
+    const Vertex* v = (const Vertex*)(data + offset);
+    offset += sizeof(Vertex) * header.nVertices;
+    const unsigned int* idx = (const unsigned int*)(data + offset);
+    offset += sizeof(unsigned int) * header.nIndices;
+    const MeshObject* m = (const MeshObject*)(data + offset);
+    offset += sizeof(MeshObject) * header.nMeshes;
+
+    texturePaths.assign(header.nMaterials, {});
+    for (auto& slots : texturePaths) {
+        for (std::string& path : slots) {
+            uint32_t length;
+            if (size - offset < sizeof(length)) return stale();
+            memcpy(&length, data + offset, sizeof(length));
+            offset += sizeof(length);
+            if (size - offset < length) return stale();
+            path.assign((const char*)data + offset, length);
+            offset += length;
+        }
+    }
+
+    // CPU copies for callers that read the mesh (e.g. hair roots). The GL buffers are created from the mapping
+    vertexData.assign(v, v + header.nVertices);
+    indices.assign(idx, idx + header.nIndices);
+    meshes.assign(m, m + header.nMeshes);
+    materials.assign(header.nMaterials, {});
+
+    std::string dir = MODELPATH(mesh_file_name);
+    Texture* Material::*slotTextures[3] = {&Material::diffTex, &Material::mtlsTex, &Material::normTex};
+    for (unsigned int i = 0; i < header.nMaterials; i++) {
+        for (int t = 0; t < 3; t++) {
+            if (texturePaths[i][t].empty()) continue;
+            Texture* tex = new Texture(GL_TEXTURE_2D);
+            tex->decode(dir + texturePaths[i][t]);  // missing files are reported but do not fail the mesh
+            materials[i].*slotTextures[t] = tex;
+        }
+    }
+    return true;
+}
+
+// Write the imported mesh to the cache at `cache_file_name`. See `loadMeshCache`
+void StaticMesh::saveMeshCache(std::string cache_file_name, std::string mesh_file_name) {
+    MeshCacheHeader header = {};
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.loadFlags = AI_LOAD_FLAGS;
+    header.nVertices = vertexData.size();
+    header.nIndices = indices.size();
+    header.nMeshes = meshes.size();
+    header.nMaterials = texturePaths.size();
+    stampSources(MODELPATH(mesh_file_name) + mesh_file_name, header.sources);
+
+    // write beside the cache and rename, so a reader never maps a partly written file
+    std::string tmp = cache_file_name + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return;
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)vertexData.data(), sizeof(Vertex) * vertexData.size());
+        out.write((const char*)indices.data(), sizeof(unsigned int) * indices.size());
+        out.write((const char*)meshes.data(), sizeof(MeshObject) * meshes.size());
+        for (const auto& slots : texturePaths) {
+            for (const std::string& path : slots) {
+                uint32_t length = path.size();
+                out.write((const char*)&length, sizeof(length));
+                out.write(path.data(), length);
+            }
+        }
+        if (!out) return;
     }
+    std::error_code ec;
+    std::filesystem::rename(tmp, cache_file_name, ec);
+    if (ec) std::filesystem::remove(tmp, ec);
+}
 
+// Create the GL buffers and textures of an imported mesh. Must run on the GL context thread
+bool StaticMesh::upload() {
+    uploadMaterials();
+    if (populateBuffer) populateBuffers();
+    meshCache.close();
     glBindVertexArray(0);  // avoid modifying VAO between loads
 
-    if (valid_scene) printf("Successfully loaded %sstatic mesh \"%s\"\n", popBuffers ? "" : "variant ", name.c_str());
-    return valid_scene;
+    bool valid = glGetError() == GL_NO_ERROR;
+    if (valid) printf("Successfully loaded %sstatic mesh \"%s\"\n", populateBuffer ? "" : "variant ", name.c_str());
+    return valid;
 }
 
 bool StaticMesh::initScene(const aiScene* scene, std::string file_name) {
@@ -59,12 +219,7 @@ bool StaticMesh::initScene(const aiScene* scene, std::string file_name) {
         initSingleMesh(am);
     }
 
-    if (!initMaterials(scene, file_name)) {
-        return false;
-    }
-
-    if (populateBuffer) populateBuffers();
-    return glGetError() == GL_NO_ERROR;
+    return initMaterials(scene, file_name);
 }
 
 // Initialise a single mesh object and add its values (vertices, indices, positions, normals, and texture coordinates) to the parent mesh.
@@ -96,7 +251,7 @@ void StaticMesh::initSingleMesh(const aiMesh* amesh) {
 /// Initialise the materials and textures used in the mesh.
 bool StaticMesh::initMaterials(const aiScene* scene, std::string model_file_name) {
     std::string dir = MODELPATH(model_file_name);
-    std::vector<std::string> paths;
+    texturePaths.assign(scene->mNumMaterials, {});
     for (unsigned int i = 0; i < scene->mNumMaterials; i++) {
         const aiMaterial* pMaterial = scene->mMaterials[i];
 
@@ -106,9 +261,10 @@ bool StaticMesh::initMaterials(const aiScene* scene, std::string model_file_name
             if (pMaterial->GetTexture(aiTextureType_DIFFUSE, 0, &Path, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS) {
                 const aiTexture* embeddedTex = scene->GetEmbeddedTexture(Path.C_Str());
                 if (embeddedTex) {
+                    cacheable = false;
                     materials[i].diffTex = new Texture(GL_TEXTURE_2D);
                     unsigned int buffer = embeddedTex->mWidth;
-                    materials[i].diffTex->load(buffer, embeddedTex->pcData);
+                    materials[i].diffTex->decode(buffer, embeddedTex->pcData);
                     printf("%s: embedded diffuse texture type %s\n", name.c_str(), embeddedTex->achFormatHint);
                 } else {
                     std::string p(Path.data);
@@ -116,14 +272,10 @@ bool StaticMesh::initMaterials(const aiScene* scene, std::string model_file_name
                     if (p.substr(0, 2) == ".\\") {
                         p = p.substr(2, p.size() - 2);
                     }
+                    texturePaths[i][0] = p;
                     std::string fullPath = dir + p;
                     materials[i].diffTex = new Texture(GL_TEXTURE_2D);
-                    if (materials[i].diffTex->load(fullPath)) {
-                        // printf("%s: Loaded diffuse texture '%s'\n", name.c_str(), fullPath.c_str());
-                    } else {
-                        printf("Error loading diffuse texture '%s'\n", fullPath.c_str());
-                        return false;
-                    }
+                    materials[i].diffTex->decode(fullPath);  // missing files are reported but do not fail the mesh
                 }
             }
         }
@@ -134,9 +286,10 @@ bool StaticMesh::initMaterials(const aiScene* scene, std::string model_file_name
             if (pMaterial->GetTexture(aiTextureType_METALNESS, 0, &Path, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS) {
                 const aiTexture* embeddedTex = scene->GetEmbeddedTexture(Path.C_Str());
                 if (embeddedTex) {
+                    cacheable = false;
                     materials[i].mtlsTex = new Texture(GL_TEXTURE_2D);
                     unsigned int buffer = embeddedTex->mWidth;
-                    materials[i].mtlsTex->load(buffer, embeddedTex->pcData);
+                    materials[i].mtlsTex->decode(buffer, embeddedTex->pcData);
                     printf("%s: embedded metalness texture type %s\n", name.c_str(), embeddedTex->achFormatHint);
                 } else {
                     std::string p(Path.data);
@@ -144,14 +297,10 @@ bool StaticMesh::initMaterials(const aiScene* scene, std::string model_file_name
                     if (p.substr(0, 2) == ".\\") {
                         p = p.substr(2, p.size() - 2);
                     }
+                    texturePaths[i][1] = p;
                     std::string fullPath = dir + p;
                     materials[i].mtlsTex = new Texture(GL_TEXTURE_2D);
-                    if (materials[i].mtlsTex->load(fullPath)) {
-                        // printf("%s: Loaded metalness texture '%s'\n", name.c_str(), fullPath.c_str());
-                    } else {
-                        printf("Error loading metalness texture '%s'\n", fullPath.c_str());
-                        return false;
-                    }
+                    materials[i].mtlsTex->decode(fullPath);  // missing files are reported but do not fail the mesh
                 }
             }
         }
@@ -162,9 +311,10 @@ bool StaticMesh::initMaterials(const aiScene* scene, std::string model_file_name
             if (pMaterial->GetTexture(aiTextureType_NORMALS, 0, &Path, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS) {
                 const aiTexture* embeddedTex = scene->GetEmbeddedTexture(Path.C_Str());
                 if (embeddedTex) {
+                    cacheable = false;
                     materials[i].normTex = new Texture(GL_TEXTURE_2D);
                     unsigned int buffer = embeddedTex->mWidth;
-                    materials[i].normTex->load(buffer, embeddedTex->pcData);
+                    materials[i].normTex->decode(buffer, embeddedTex->pcData);
                     printf("%s: embedded normal texture type %s\n", name.c_str(), embeddedTex->achFormatHint);
                 } else {
                     std::string p(Path.data);
@@ -172,20 +322,25 @@ bool StaticMesh::initMaterials(const aiScene* scene, std::string model_file_name
                     if (p.substr(0, 2) == ".\\") {
                         p = p.substr(2, p.size() - 2);
                     }
+                    texturePaths[i][2] = p;
                     std::string fullPath = dir + p;
                     materials[i].normTex = new Texture(GL_TEXTURE_2D);
-                    if (materials[i].normTex->load(fullPath)) {
-                        // printf("%s: Loaded normal texture '%s'\n", name.c_str(), fullPath.c_str());
-                    } else {
-                        printf("Error loading normal texture '%s'\n", fullPath.c_str());
-                        return false;
-                    }
+                    materials[i].normTex->decode(fullPath);  // missing files are reported but do not fail the mesh
                 }
             }
         }
     }
 
-    return glGetError() == GL_NO_ERROR;
+    return true;
+}
+
+// Create the GL textures of every material from their decoded images
+void StaticMesh::uploadMaterials() {
+    for (auto& m : materials) {
+        if (m.diffTex) m.diffTex->upload();
+        if (m.mtlsTex) m.mtlsTex->upload();
+        if (m.normTex) m.normTex->upload();
+    }
 }
 
 /// <summary>
@@ -198,9 +353,16 @@ void StaticMesh::populateBuffers() {
     glCreateBuffers(1, &EBO);
     glCreateBuffers(1, &IBO);
 
-    glNamedBufferStorage(VBO, sizeof(vertexData[0]) * vertexData.size(), &vertexData[0], GL_MAP_READ_BIT);
+    // upload straight from the mesh cache if the mesh was loaded from one
+    const void* vertexSrc = vertexData.data();
+    const void* indexSrc = indices.data();
+    if (meshCache.isOpen()) {
+        vertexSrc = meshCache.data() + sizeof(MeshCacheHeader);
+        indexSrc = (const unsigned char*)vertexSrc + sizeof(Vertex) * vertexData.size();
+    }
+    glNamedBufferStorage(VBO, sizeof(vertexData[0]) * vertexData.size(), vertexSrc, GL_MAP_READ_BIT);
     glVertexArrayVertexBuffer(VAO, ST_POSITION_LOC, VBO, 0, sizeof(Vertex));
-    glNamedBufferStorage(EBO, sizeof(indices[0]) * indices.size(), &indices[0], GL_MAP_READ_BIT);
+    glNamedBufferStorage(EBO, sizeof(indices[0]) * indices.size(), indexSrc, GL_MAP_READ_BIT);
     glVertexArrayElementBuffer(VAO, EBO);
 
     glEnableVertexArrayAttrib(VAO, ST_POSITION_LOC);
@@ -3,12 +3,19 @@
 
 #pragma warning(disable : 26495)
 
+#include <array>
+
+#include "mappedfile.h"
 #include "mesh.h"
 
 #define AI_LOAD_FLAGS aiProcess_Triangulate | aiProcess_PreTransformVertices | aiProcess_CalcTangentSpace
+#define MESH_CACHE_EXTENSION ".meshcache"  // written next to the model file
 
 class StaticMesh : public Mesh {
    public:
+    // Load imported meshes from, and save them to, binary caches next to their model files. See `loadMeshCache`
+    static inline bool useMeshCache = true;
+
     // Create a new Mesh object without a mesh
     StaticMesh() { name = "NewStaticMesh" + std::to_string(SM::unnamedStaticMeshCount++); }
 
@@ -41,9 +48,14 @@ class StaticMesh : public Mesh {
 
     bool loadMesh(std::string mesh_file_name) { return loadMesh(mesh_file_name, true); }
     bool loadMesh(std::string mesh_file_name, bool popBuffer);
+    bool importMesh(std::string mesh_file_name);  // CPU half of `loadMesh`. Safe to run on any thread
+    bool upload();                                // GL half of `loadMesh`. Must run on the GL context thread
     bool initScene(const aiScene*, std::string);
     void initSingleMesh(const aiMesh*);
     bool initMaterials(const aiScene*, std::string);
+    void uploadMaterials();
+    bool loadMeshCache(std::string cache_file_name, std::string mesh_file_name);
+    void saveMeshCache(std::string cache_file_name, std::string mesh_file_name);
     void populateBuffers();
     void render(unsigned int, const mat4*);                // render an array of meshes using instancing
     void render(unsigned int, const mat4*, const float*);  // render an array of meshes using instancing and atlas depths
@@ -60,6 +72,9 @@ class StaticMesh : public Mesh {
     void update(Shader* shader, float speed) {}                                                    // not implemented
 
     unsigned int tn_VBO = 0;
+    MappedFile meshCache;                                   // mapped cache the mesh was loaded from. Released after upload
+    std::vector<std::array<std::string, 3>> texturePaths;  // diffuse, metalness and normal texture of each material
+    bool cacheable = true;                                  // false if a texture is embedded in the model file
 #define ST_POSITION_LOC 0  // p_vbo
 #define ST_NORMAL_LOC 1    // n_vbo
 #define ST_TEXTURE_LOC 2   // t_vbo
@@ -18,50 +18,68 @@ bool Texture::load(bool flip) {
 }
 
 bool Texture::load(std::string tex, bool flip) {
+    decode(tex, flip);
+    return upload();
+}
+
+bool Texture::decode(std::string tex, bool flip) {
+    stbi_set_flip_vertically_on_load_thread(flip);
+    pixels = stbi_load(tex.c_str(), &width_, &height_, &nrChannels_, 0);
+    mipmapped = true;
+    if (!pixels) std::cout << "Failed to load texture " << tex.c_str() << std::endl;
+    return pixels != nullptr;
+}
+
+bool Texture::decode(unsigned int buffer, void* img_data) {
+    stbi_set_flip_vertically_on_load_thread(true);
+    pixels = stbi_load_from_memory((const stbi_uc*)img_data, buffer, &width_, &height_, &nrChannels_, 0);
+    mipmapped = false;
+    return pixels != nullptr;
+}
+
+bool Texture::upload() {
+    if (textureEnum != GL_TEXTURE_2D) {
+        printf("Texture type %x is not supported.", textureEnum);
+        exit(1);  // exit if trying to load different texture type
+    }
     glGenTextures(1, &texture);
-    // load and generate the texture
-    stbi_set_flip_vertically_on_load(flip);
-    unsigned char* data = stbi_load(tex.c_str(), &width_, &height_, &nrChannels_, 0);
-    if (data) {
-        if (textureEnum == GL_TEXTURE_2D) {
-            glBindTexture(textureEnum, texture);
-            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // align data to 1-byte. used to prevent warping of certain textures.
-            GLint bpp = 0;
-            switch (nrChannels_) {
-                case 1:
-                    bpp = GL_RED;
-                    break;
-                case 3:
-                    bpp = GL_RGB;
-                    break;
-                case 4:
-                    bpp = GL_RGBA;
-                    break;
-                default:
-                    printf("unsupported image bits per pixel");
-                    break;
-            }
-            glTexImage2D(textureEnum, 0, bpp, width_, height_, 0, bpp, GL_UNSIGNED_BYTE, data);
-            glGenerateMipmap(textureEnum);
-            // set the texture wrapping/filtering options (on the currently bound texture object)
-            glTexParameteri(textureEnum, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTexParameteri(textureEnum, GL_TEXTURE_WRAP_T, GL_REPEAT);
-            glTexParameteri(textureEnum, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-            glTexParameteri(textureEnum, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        } else {
-            printf("Texture type %x is not supported.", textureEnum);
-            exit(1);  // exit if trying to load different texture type
-        }
-    } else {
-        std::cout << "Failed to load texture " << tex.c_str() << std::endl;
+    if (!pixels) return glGetError() == GL_NO_ERROR;
+
+    glBindTexture(textureEnum, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // align data to 1-byte. used to prevent warping of certain textures.
+    GLint format = 0, internalFormat = 0;
+    switch (nrChannels_) {
+        case 1:
+            format = internalFormat = GL_RED;
+            break;
+        case 3:
+            format = GL_RGB;
+            internalFormat = mipmapped ? GL_RGB : GL_RGB8;
+            break;
+        case 4:
+            format = internalFormat = GL_RGBA;
+            break;
+        default:
+            printf("unsupported image bits per pixel");
+            stbi_image_free(pixels);
+            pixels = nullptr;
+            return false;
     }
-    stbi_image_free(data);
-    // glBindTexture(GL_TEXTURE_2D, 0);
+    glTexImage2D(textureEnum, 0, internalFormat, width_, height_, 0, format, GL_UNSIGNED_BYTE, pixels);
+    stbi_image_free(pixels);
+    pixels = nullptr;
+
+    // set the texture wrapping/filtering options (on the currently bound texture object)
+    if (mipmapped) glGenerateMipmap(textureEnum);
+    glTexParameteri(textureEnum, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(textureEnum, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(textureEnum, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(textureEnum, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     return glGetError() == GL_NO_ERROR;
 }
 
 bool Texture::_loadAtlas(std::string path, int tileSize, int tiles) {
-    stbi_set_flip_vertically_on_load(true);
+    stbi_set_flip_vertically_on_load_thread(true);
     unsigned char* data = stbi_load(path.c_str(), &width_, &height_, &nrChannels_, 0);
     if (data) {
         if (textureEnum == GL_TEXTURE_2D_ARRAY) {
@@ -126,7 +144,7 @@ bool Texture::loadCubemap(std::vector<std::string> faces) {
 
     // load and generate the texture
     for (int i = 0; i < faces.size(); i++) {
-        stbi_set_flip_vertically_on_load(false);
+        stbi_set_flip_vertically_on_load_thread(false);
         unsigned char* data = stbi_load(faces[i].c_str(), &width_, &height_, &nrChannels_, 0);
         if (data) {
             glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // align data to 1-byte. used to prevent warping of certain textures.
@@ -163,31 +181,6 @@ bool Texture::loadCubemap(std::vector<std::string> faces) {
 }
 
 bool Texture::load(unsigned int buffer, void* img_data) {
-    void* data = stbi_load_from_memory((const stbi_uc*)img_data, buffer, &width_, &height_, &nrChannels_, 0);
-    stbi_set_flip_vertically_on_load(true);
-    glGenTextures(1, &texture);
-    glBindTexture(textureEnum, texture);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // align data to 1-byte. used to prevent warping of certain textures.
-    switch (nrChannels_) {
-        case 1:
-            glTexImage2D(textureEnum, 0, GL_RED, width_, height_, 0, GL_RED, GL_UNSIGNED_BYTE, data);
-            break;
-        case 3:
-            glTexImage2D(textureEnum, 0, GL_RGB8, width_, height_, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-            break;
-        case 4:
-            glTexImage2D(textureEnum, 0, GL_RGBA, width_, height_, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-            break;
-        default:
-            printf("unsupported image bits per pixel");
-            stbi_image_free(data);
-            return false;
-    }
-
-    // set texture parameters
-    glTexParameteri(textureEnum, GL_TEXTURE_MIN_FILTER, GL_LINEAR);  // minification
-    glTexParameteri(textureEnum, GL_TEXTURE_MAG_FILTER, GL_LINEAR);  // magnification
-    glTexParameteri(textureEnum, GL_TEXTURE_WRAP_S, GL_REPEAT);      // u coordinate (x)
-    glTexParameteri(textureEnum, GL_TEXTURE_WRAP_T, GL_REPEAT);      // v coordinate (y)
-    return glGetError() == GL_NO_ERROR;
+    if (!decode(buffer, img_data)) return false;
+    return upload();
 }
@@ -42,6 +42,15 @@ class Texture {
     // load from memory buffer (embedded textures)
     bool load(unsigned int, void*);
 
+    // Decode the image file `tex` into memory without touching GL, so that it may run on any thread. See `upload`
+    bool decode(std::string tex, bool flip = true);
+
+    // Decode an image from a memory buffer (embedded textures) without touching GL
+    bool decode(unsigned int, void*);
+
+    // Create the GL texture from the decoded image and free it. Must run on the GL context thread
+    bool upload();
+
     // load an atlas of textures.
     // `tiles` is the number of actual, non-empty tiles in the atlas, and `tileSize` is the width (and height) of a single tile.
     bool loadAtlas(std::string tex, int tileSize, int tiles);
@@ -65,6 +74,8 @@ class Texture {
     unsigned int texture = 0;
     int width_ = 0, height_ = 0, nrChannels_ = 0;
     bool isAtlas = false;
+    unsigned char* pixels = nullptr;  // decoded image waiting for `upload`
+    bool mipmapped = true;            // file textures are mipmapped, embedded ones are not
 };
 
 #endif /* TEXTURE_H */
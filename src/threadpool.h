@@ -0,0 +1,110 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads.
+// `parallelFor` splits an index range into chunks which the workers and the calling thread pull from until the range is exhausted.
+// Calls may not be nested; a worker must not call `parallelFor` on its own pool.
+class ThreadPool {
+   public:
+    // Create a pool using `nThreads` threads in total, including the calling thread
+    ThreadPool(int nThreads = std::thread::hardware_concurrency()) {
+        nThreads = std::max(nThreads, 1);
+        for (int i = 0; i < nThreads - 1; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        wakeCv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    // Number of threads that take part in a `parallelFor`, including the calling thread
+    int size() const { return workers.size() + 1; }
+
+    // Run `fn(i)` for every `i` in [`begin`, `end`). Blocks until every iteration has finished.
+    // `grain` is the number of consecutive indices a thread takes at a time.
+    template <typename F>
+    void parallelFor(int begin, int end, F&& fn, int grain = 256) {
+        run(begin, end, grain, [&fn](int s, int e) {
+            for (int i = s; i < e; ++i) fn(i);
+        });
+    }
+
+    // Run `fn(s, e)` over chunks [`s`, `e`) covering [`begin`, `end`). Blocks until every chunk has finished.
+    void run(int begin, int end, int grain, const std::function<void(int, int)>& body) {
+        if (end <= begin) return;
+        grain = std::max(grain, 1);
+        if (workers.empty() || end - begin <= grain) {
+            body(begin, end);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            job = &body;
+            next = begin;
+            jobEnd = end;
+            jobGrain = grain;
+            pending = workers.size();
+            generation++;
+        }
+        wakeCv.notify_all();
+        work();  // the calling thread helps out
+
+        std::unique_lock<std::mutex> lk(mtx);
+        doneCv.wait(lk, [this] { return pending == 0; });
+        job = nullptr;
+    }
+
+   private:
+    // Pull chunks from the current job until none are left
+    void work() {
+        for (;;) {
+            int s = next.fetch_add(jobGrain);
+            if (s >= jobEnd) break;
+            (*job)(s, std::min(s + jobGrain, jobEnd));
+        }
+    }
+
+    void workerLoop() {
+        size_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                wakeCv.wait(lk, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            work();
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                if (--pending == 0) doneCv.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable wakeCv;
+    std::condition_variable doneCv;
+    const std::function<void(int, int)>* job = nullptr;
+    std::atomic<int> next{0};
+    int jobEnd = 0;
+    int jobGrain = 1;
+    size_t pending = 0;
+    size_t generation = 0;
+    bool stopping = false;
+};
+
+#endif /* THREADPOOL_H */
@@ -0,0 +1,109 @@
+#include "trace.h"
+#include "clock.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Trace {
+std::atomic<bool> enabled = false;
+
+namespace {
+// Ring buffer of the zones finished on one thread
+struct ThreadBuffer {
+    std::vector<Event> events = std::vector<Event>(TRACE_BUFFER_EVENTS);
+    uint64_t head = 0;  // zones recorded so far. The newest zone is at `(head - 1) % TRACE_BUFFER_EVENTS`
+    int tid = 0;
+    std::string name;
+};
+
+std::mutex registryMtx;
+std::vector<std::unique_ptr<ThreadBuffer>> registry;  // buffers outlive their threads so that they can still be dumped
+thread_local ThreadBuffer* localBuffer = nullptr;
+
+ThreadBuffer* threadBuffer() {
+    if (localBuffer) return localBuffer;
+    std::lock_guard<std::mutex> lk(registryMtx);
+    registry.push_back(std::make_unique<ThreadBuffer>());
+    localBuffer = registry.back().get();
+    localBuffer->tid = registry.size();
+    localBuffer->name = localBuffer->tid == 1 ? "main" : "thread " + std::to_string(localBuffer->tid);
+    return localBuffer;
+}
+
+// Write `s` as a JSON string
+void writeString(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        if ((unsigned char)*s >= 0x20) fputc(*s, f);
+    }
+    fputc('"', f);
+}
+}  // namespace
+
+int64_t now() {
+    return Clock::now();
+}
+
+void record(const char* name, const char* detail, int64_t start, int64_t end) {
+    ThreadBuffer* buf = threadBuffer();
+    Event& e = buf->events[buf->head % TRACE_BUFFER_EVENTS];
+    e.name = name;
+    e.start = start;
+    e.duration = end - start;
+    e.detail[0] = '\0';
+    if (detail) {
+        strncpy(e.detail, detail, TRACE_DETAIL_LENGTH - 1);
+        e.detail[TRACE_DETAIL_LENGTH - 1] = '\0';
+    }
+    buf->head++;
+}
+
+void setThreadName(const char* name) {
+    threadBuffer()->name = name;
+}
+
+bool dump(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "ERROR: could not open %s for the trace\n", path);
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(registryMtx);
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (auto& buf : registry) {
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",\n", buf->tid);
+        writeString(f, buf->name.c_str());
+        fprintf(f, "}}");
+        first = false;
+
+        uint64_t count = std::min<uint64_t>(buf->head, TRACE_BUFFER_EVENTS);
+        for (uint64_t i = buf->head - count; i < buf->head; ++i) {
+            const Event& e = buf->events[i % TRACE_BUFFER_EVENTS];
+            fprintf(f, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":", buf->tid, e.start * 1e-3,
+                    e.duration * 1e-3);
+            writeString(f, e.name);
+            if (e.detail[0]) {
+                fprintf(f, ",\"args\":{\"detail\":");
+                writeString(f, e.detail);
+                fputc('}', f);
+            }
+            fputc('}', f);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return true;
+}
+
+void clear() {
+    std::lock_guard<std::mutex> lk(registryMtx);
+    for (auto& buf : registry) buf->head = 0;
+}
+}  // namespace Trace
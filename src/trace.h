@@ -0,0 +1,65 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+
+#define TRACE_BUFFER_EVENTS (1 << 16)  // zones kept per thread. Older zones are overwritten once a thread's buffer is full
+#define TRACE_DETAIL_LENGTH 48         // characters of a zone's detail string kept, including the terminator
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Time the rest of the enclosing scope as a zone called `name`, which must be a string literal.
+// An optional second argument adds a detail string (e.g. a file name) shown with the zone
+#define TRACE_ZONE(...) Trace::Zone TRACE_CONCAT(traceZone_, __LINE__)(__VA_ARGS__)
+
+// Scoped CPU timeline tracing, written out in the Chrome trace-event format (chrome://tracing or ui.perfetto.dev).
+// Each thread records finished zones into its own ring buffer, so recording takes no locks.
+// While tracing is off a zone costs a single relaxed atomic load, so zones can stay compiled into every build.
+namespace Trace {
+struct Event {
+    const char* name;
+    int64_t start;     // `Clock::now()` nanoseconds
+    int64_t duration;  // nanoseconds
+    char detail[TRACE_DETAIL_LENGTH];
+};
+
+extern std::atomic<bool> enabled;
+
+// Nanoseconds on the program clock. See clock.h
+int64_t now();
+
+// Record a finished zone on the calling thread
+void record(const char* name, const char* detail, int64_t start, int64_t end);
+
+// Name the calling thread in the trace
+void setThreadName(const char* name);
+
+// Write every recorded zone to `path` as Chrome trace-event JSON. Other threads must not be recording zones meanwhile
+bool dump(const char* path);
+
+// Discard every recorded zone
+void clear();
+
+class Zone {
+   public:
+    Zone(const char* zoneName, const char* zoneDetail = nullptr) {
+        if (!enabled.load(std::memory_order_relaxed)) return;
+        name = zoneName;
+        detail = zoneDetail;
+        start = now();
+    }
+    ~Zone() {
+        if (name) record(name, detail, start, now());
+    }
+    Zone(const Zone&) = delete;
+    Zone& operator=(const Zone&) = delete;
+
+   private:
+    const char* name = nullptr;  // null if tracing was off when the zone opened
+    const char* detail = nullptr;
+    int64_t start = 0;
+};
+}  // namespace Trace
+
+#endif /* TRACE_H */